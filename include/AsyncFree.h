@@ -0,0 +1,80 @@
+#pragma once
+#include "Common.h"
+
+#include <condition_variable>
+
+// 异步释放队列：开启异步释放的线程独占一个，单生产者（该线程）单消费者（后台回收线程），无锁
+// 每项是一批同样大小的对象（ThreadCache归还CentralCache的一批）或一块大块内存
+class AsyncFreeQueue {
+ public:
+  struct Entry {
+    void* _start;
+    void* _end;
+    size_t _objSize;  // 0表示_start是一块大块内存
+  };
+
+  // 由所属线程调用，队列满时返回false，由调用者同步释放
+  bool Push(void* start, void* end, size_t objSize);
+  // 由回收线程调用
+  bool Pop(Entry& entry);
+
+  // 队列满而同步释放的次数，只由所属线程写入
+  size_t Fallbacks() const { return _fallbacks.load(std::memory_order_relaxed); }
+  void CountFallback() {
+    _fallbacks.store(_fallbacks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+ private:
+  friend class AsyncReclaimer;
+
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> _head{0};  // 下一个出队位置，回收线程写入
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> _tail{0};  // 下一个入队位置，所属线程写入
+  std::atomic<size_t> _fallbacks{0};
+  Entry _entries[ASYNC_FREE_QUEUE];
+  AsyncFreeQueue* _next = nullptr;  // 所有队列组成的单链表，只增不减
+  bool _abandoned = false;          // 所属线程已退出，可交给新线程，由回收器的锁保护
+};
+
+// 单例模式 -- 懒汉式
+// 后台回收线程：轮询各异步释放队列，在自己的线程中加桶锁、页堆锁完成释放，
+// 空闲时逐步拉长轮询间隔，所属线程入队时不做系统调用
+class AsyncReclaimer {
+ public:
+  static AsyncReclaimer& Instance() {
+    // Magic Static，局部静态变量初始化时保证线程安全
+    static AsyncReclaimer instance;
+    return instance;
+  }
+
+  // 为调用线程分配一个队列：优先复用已退出线程交还的队列，否则创建并登记，首次调用时启动回收线程
+  AsyncFreeQueue* Register();
+  // 线程退出时交还队列，剩余的项仍由回收线程处理
+  void Unregister(AsyncFreeQueue* queue);
+  // 同步执行一项释放，回收线程与队列满时的所属线程共用
+  static void Release(const AsyncFreeQueue::Entry& entry);
+
+  // 在调用线程中清空所有队列，返回处理的项数，不得持有桶锁或页堆锁
+  size_t DrainNow() { return Drain(); }
+
+  // 回收线程已处理的项数
+  size_t Reclaimed() const { return _reclaimed.load(std::memory_order_relaxed); }
+
+ private:
+  AsyncReclaimer();
+  ~AsyncReclaimer();
+  AsyncReclaimer(const AsyncReclaimer&) = delete;
+  AsyncReclaimer& operator=(const AsyncReclaimer&) = delete;
+
+  void Run();
+  // 清空所有队列，返回处理的项数；各队列只允许一个消费者，回收线程与DrainNow在_drainMutex下互斥
+  size_t Drain();
+
+ private:
+  std::atomic<AsyncFreeQueue*> _queues{nullptr};
+  std::atomic<size_t> _reclaimed{0};
+  std::mutex _mutex;
+  std::mutex _drainMutex;
+  std::condition_variable _cond;
+  bool _stop = false;
+  std::thread _thread;
+};
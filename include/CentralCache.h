@@ -12,19 +12,64 @@ class CentralCache {
 
   // 与ThreadCache交互
   void InsertRange(void* start, void* end, size_t objSize);
-  size_t RemoveRange(void*& start, void*& end, size_t batchNum, size_t objSize);
+  size_t RemoveRange(void*& start, void*& end, size_t batchNum, size_t objSize, size_t shard = 0);
   // 与PageHeap交互
   Span* AllocateSpan(SpanList& list, size_t objSize);
   void DeallocateSpans(SpanList& list, Span* span);
 
-  Span* FetchSpan(SpanList& list, size_t objSize);
-  void ReleaseToSpans(SpanList& list, void* obj);
+  Span* FetchSpan(SpanList& list, size_t objSize, size_t& scanned);
+  void ReleaseToSpans(SpanList& list, void* obj, Span* span);
+
+  // 新申请的Span是否用位图管理空闲对象，已有的Span保持原来的形式
+  void SetBitmapSpans(bool enable) { _bitmapSpans.store(enable, std::memory_order_relaxed); }
+
+  // 每个分片最多保留spans个完全空闲的Span，超出的归还PageHeap，0表示立即归还
+  void SetEmptySpanLimit(size_t spans) { _emptyLimit.store(spans, std::memory_order_relaxed); }
+  // 将保留的空闲Span全部归还PageHeap，返回归还的个数，调用时不能持有任何锁
+  size_t ReleaseEmptySpans();
+  // 请求下次向PageHeap申请Span前归还保留的空闲Span，可在持有页堆锁时调用
+  void RequestReleaseEmpty() { _releaseRequested.store(true, std::memory_order_relaxed); }
+
+  // CentralCache获取页堆锁的次数
+  size_t HeapLockAcquires() const { return _heapLocks.load(std::memory_order_relaxed); }
+#ifdef CONCUR_LOCK_PROFILE
+  // 桶锁发生等待的次数与累计等待时间(ns)
+  size_t LockWaits() const { return _lockWaits.load(std::memory_order_relaxed); }
+  size_t LockWaitNs() const { return _lockWaitNs.load(std::memory_order_relaxed); }
+  // 按哈希桶汇总各分片桶锁的竞争统计，打印等待时间最长的topN个桶及其等待者调用栈采样
+  void DumpLockProfile(size_t topN);
+#endif
 
  private:
-  CentralCache() {}
+  CentralCache();
   CentralCache(const CentralCache&) = delete;
   CentralCache& operator=(const CentralCache&) = delete;
 
+  // 加桶锁，启用锁竞争统计时统计拿不到锁的等待时间
+  void Lock(SpanList& list);
+  // 查找第一个非空的Span，没有返回nullptr，scanned累加跳过的Span数
+  Span* FindSpan(SpanList& list, size_t index, size_t& scanned);
+  // Span中是否还有空闲对象，位图Span由分配数与容量比较得出，不访问位图
+  bool HasFree(const Span* span, size_t index) const {
+    return span->_bitmapped ? span->_useCount < _spanObjects[index] : span->_freeList != nullptr;
+  }
+  // 按位扫描取出至多batchNum个空闲对象，串成链表交给ThreadCache
+  size_t TakeFromBitmap(Span* span, size_t index, size_t batchNum, void*& start, void*& end);
+  // Span归还PageHeap前释放其位图
+  void ResetSpan(Span* span);
+  // 热点哈希桶分为CENTRAL_SHARDS个分片，各自持有Span与桶锁
+  static size_t ShardNum(size_t objSize) { return objSize <= SHARD_MAX_BYTES ? CENTRAL_SHARDS : 1; }
+
  private:
-  SpanList _spanLists[LIST_NUM];
+  SpanList _spanLists[LIST_NUM][CENTRAL_SHARDS];
+  uint16_t _spanObjects[CLASS_NUM];  // 各哈希桶一个Span切分的对象数
+  uint64_t _divMagic[CLASS_NUM];     // 对象偏移除以对象大小的乘法逆元，见ReleaseToSpans
+  std::atomic<bool> _bitmapSpans{true};
+  std::atomic<size_t> _emptyLimit{EMPTY_SPAN_LIMIT};
+  std::atomic<bool> _releaseRequested{false};
+  std::atomic<size_t> _heapLocks{0};
+#ifdef CONCUR_LOCK_PROFILE
+  std::atomic<size_t> _lockWaits{0};
+  std::atomic<size_t> _lockWaitNs{0};
+#endif
 };
\ No newline at end of file
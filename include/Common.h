@@ -8,6 +8,8 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <mutex>
 #include <thread>
@@ -16,11 +18,85 @@
 using std::cout;
 using std::endl;
 
+// 快速路径的分支预测提示，慢路径函数标记为冷代码且不内联，使快速路径保持紧凑
+#if defined(__GNUC__) || defined(__clang__)
+#define CONCUR_LIKELY(x) __builtin_expect(!!(x), 1)
+#define CONCUR_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define CONCUR_COLD __attribute__((cold, noinline))
+// initial-exec模型使动态库中的TLS访问无需调用__tls_get_addr
+#define CONCUR_TLS __thread __attribute__((tls_model("initial-exec")))
+#else
+#define CONCUR_LIKELY(x) (x)
+#define CONCUR_UNLIKELY(x) (x)
+#define CONCUR_COLD __declspec(noinline)
+#define CONCUR_TLS thread_local
+#endif
+
+// USDT静态探针：系统提供sys/sdt.h（systemtap-sdt-dev）时在慢路径埋点，provider为concur，
+// 可用bpftrace -e 'usdt:./build/test:concur:refill {...}'或perf probe挂载，未挂载时只是一条nop
+// 编译时定义CONCUR_NO_PROBES可去掉探针
+#if defined(__has_include) && !defined(CONCUR_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CONCUR_PROBE(name, arg1, arg2) DTRACE_PROBE2(concur, name, arg1, arg2)
+#endif
+#endif
+#ifndef CONCUR_PROBE
+#define CONCUR_PROBE(name, arg1, arg2) ((void)sizeof(arg1), (void)sizeof(arg2))
+#endif
+
 static const size_t MAX_BYTES = 256 << 10;
 static const size_t LIST_NUM = 256;
+static const size_t CLASS_NUM = 208;  // 实际使用的哈希桶数
 static const size_t PAGE_NUM = 128;
 static const size_t PAGE_SHIFT = 13;
 static const size_t ADDRESS_BITS = sizeof(void*) << 3;
+// 用户态虚拟地址实际可用位数，x86-64/ARM64默认为48位（5级页表可编译时指定CONCUR_VA_BITS=57）
+#if defined(CONCUR_VA_BITS)
+static const size_t VA_BITS = CONCUR_VA_BITS;
+#elif defined(__x86_64__) || defined(__aarch64__) || defined(_M_X64) || defined(_M_ARM64)
+static const size_t VA_BITS = 48;
+#else
+static const size_t VA_BITS = ADDRESS_BITS;
+#endif
+static const size_t CACHE_LINE_SIZE = 64;
+// 编译时定义CONCUR_ARENA_BITS（如36即64GB）时，页堆只从启动时预留的一段连续虚拟地址中分配，
+// 页映射为按偏移索引的平坦数组，指针归属检查只需比较地址范围
+#ifdef CONCUR_ARENA_BITS
+static const size_t ARENA_BITS = CONCUR_ARENA_BITS;
+static_assert(ARENA_BITS > PAGE_SHIFT && ARENA_BITS < VA_BITS, "预留地址范围过大或过小");
+#endif
+// CentralCache热点哈希桶的分片数，可编译时指定CONCUR_CENTRAL_SHARDS=1关闭分片
+#ifdef CONCUR_CENTRAL_SHARDS
+static const size_t CENTRAL_SHARDS = CONCUR_CENTRAL_SHARDS;
+#else
+static const size_t CENTRAL_SHARDS = 4;
+#endif
+static const size_t SHARD_MAX_BYTES = 1024;  // 不超过该大小的对象所在哈希桶分片加锁
+static const size_t MAX_LIST_BATCHES = 16;     // ThreadCache自由链表最多缓存的批量数
+static const size_t MAX_OVERAGES = 3;          // 自由链表超长多少次后缩小上限
+static const size_t SCAVENGE_INTERVAL = 1 << 10;  // ThreadCache每释放多少次检查一次回收时间
+static const size_t SCAVENGE_MS = 100;            // ThreadCache按低水位回收的最短间隔
+static const size_t THREAD_CACHE_DECAY_MS = 10000;  // 线程缓存默认闲置多久后清空
+static const size_t EMPTY_SPAN_LIMIT = 1;  // CentralCache每个分片默认保留的完全空闲Span数
+static const size_t LARGE_CACHE_BYTES = 128 << 20;  // 大块Span缓存的默认字节上限
+static const size_t LARGE_CACHE_MS = 1000;          // 大块Span在缓存中的最长闲置时间
+static const size_t LARGE_SCAVENGE_MS = 128;        // 检查大块Span闲置时间的最短间隔
+static const size_t ASYNC_FREE_QUEUE = 256;         // 每个异步释放队列的容量（批）
+static const size_t ASYNC_FREE_MAX_POLL_MS = 64;    // 回收线程空闲时的最长轮询间隔
+static const size_t EPOCH_LIMBO_NUM = 3;           // 每个线程的待回收链表数，按退休时的纪元取模
+static const size_t EPOCH_RETIRE_INTERVAL = 64;     // 每退休多少个对象尝试推进一次纪元
+
+// 截断为32位毫秒，约49天回绕一次，时长用无符号差值计算
+inline uint32_t NowMs() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// 使本进程的所有线程各执行一次全屏障（linux为membarrier，windows为FlushProcessWriteBuffers），
+// 配合另一侧只加编译器屏障的同步使用，不支持时返回false
+bool ProcessBarrier();
 
 // 用于向操作系统申请与释放内存
 class SystemAllocator {
@@ -29,8 +105,63 @@ class SystemAllocator {
   static void* Alloc(size_t bytes);
   // 向堆释放空间
   static void Free(void* ptr, size_t bytes);
+  // 调整已申请空间的大小，可能搬移地址但不拷贝数据，失败返回nullptr，无法映射目标地址时抛出std::bad_alloc
+  static void* Realloc(void* ptr, size_t oldBytes, size_t newBytes);
+  // 将空间归还操作系统但保留映射，再次访问时为全零页
+  static void Release(void* ptr, size_t bytes);
+  // 预先触发空间的缺页，lock时锁定在物理内存中，失败返回false
+  static bool Populate(void* ptr, size_t bytes, bool lock);
+  // 只预留按PAGE_SHIFT对齐的虚拟地址，不可访问也不占用物理内存，失败抛出std::bad_alloc
+  static void* Reserve(size_t bytes);
+  // 提交预留地址中的一段，使其可读写，失败返回false
+  static bool Commit(void* ptr, size_t bytes);
 };
 
+#ifdef CONCUR_LOCK_PROFILE
+// 带竞争统计的互斥锁（编译时定义CONCUR_LOCK_PROFILE启用）
+// 统计数据只在持锁期间修改，由锁自身保护
+class ProfiledMutex {
+ public:
+  static const size_t SAMPLE_RATE = 16;   // 每个线程从第1次竞争起，每16次采样一次等待者调用栈
+  static const size_t SAMPLE_NUM = 4;     // 每把锁保留最近的采样数
+  static const size_t SAMPLE_DEPTH = 16;  // 调用栈最大深度
+
+  struct Stats {
+    size_t _acquires = 0;   // 加锁次数
+    size_t _contended = 0;  // 发生等待的次数
+    size_t _waitNs = 0;     // 累计等待时间
+    size_t _maxWaitNs = 0;  // 最长一次等待时间
+    size_t _holdNs = 0;     // 累计持锁时间
+
+    void Add(const Stats& other);
+  };
+  struct Sample {
+    void* _frames[SAMPLE_DEPTH];
+    int _depth = 0;
+  };
+
+  void lock();
+  bool try_lock();
+  void unlock();
+
+  // 读取统计数据与采样快照，本次加锁不计入统计
+  Stats Snapshot(Sample* samples = nullptr, size_t* sampleNum = nullptr);
+  // 打印一组统计数据与采样调用栈
+  static void Print(const char* name, const Stats& stats, const Sample* samples = nullptr,
+                    size_t sampleNum = 0);
+
+ private:
+  std::mutex _mutex;
+  Stats _stats;
+  std::chrono::steady_clock::time_point _lockTime;
+  Sample _samples[SAMPLE_NUM];
+  size_t _sampleCount = 0;
+};
+typedef ProfiledMutex ConcurMutex;
+#else
+typedef std::mutex ConcurMutex;
+#endif
+
 // 以小块内存（对象）为单位的单向链表
 class FreeList {
  public:
@@ -52,10 +183,16 @@ class FreeList {
 
   size_t& MaxSize();
 
+  size_t& LowWater();
+
+  size_t& Overages();
+
  private:
   void* _freeList = nullptr;
   size_t _size = 0;
-  size_t _maxSize = 1;  // 慢启动上限
+  size_t _maxSize = 1;   // 慢启动上限
+  size_t _lowWater = 0;  // 上次回收以来链表长度的最小值（单个取出时不更新），这部分对象一直未被使用
+  size_t _overages = 0;  // 链表超过上限的次数
 };
 
 // 字节对齐和哈希桶映射规则
@@ -70,10 +207,13 @@ class SizeMap {
   //  [64*1024+1,256*1024]  8*1024byte对齐  freelist[184,208)
 
   // 输入申请字节数，返回对齐字节数
-  static size_t RoundUp(size_t bytes);
+  static constexpr size_t RoundUp(size_t bytes);
 
   // 输入申请字节数，返回对应哈希桶的下标索引
-  static size_t Index(size_t bytes);
+  static constexpr size_t Index(size_t bytes);
+
+  // 输入哈希桶的下标索引，返回对应的对齐字节数（Index的逆运算）
+  static constexpr size_t ClassSize(size_t index);
 
   // 输入对象大小，输出（从CentralCache到ThreadCache）对象移动数量
   static size_t ObjectMoveNum(size_t objSize);
@@ -85,36 +225,159 @@ class SizeMap {
   // size_t _RoundUp(size_t bytes, size_t alignNum);
 
   // 位运算写法，较精妙（代入数字便于理解）
-  static size_t _RoundUp(size_t bytes, size_t alignNum);
+  static constexpr size_t _RoundUp(size_t bytes, size_t alignNum);
 
   // size_t _Index(size_t bytes, size_t alignNum);
 
   // 计算当前区间的第几个桶
-  static size_t _Index(size_t bytes, size_t alignShift);
+  static constexpr size_t _Index(size_t bytes, size_t alignShift);
 };
 
-// 以页为单位的连续大块内存
-struct Span {
-  // 采用uintptr_t兼容32位和64位平台
-  uintptr_t _start = 0;  // 起始页号
-  uintptr_t _size = 0;   // 页的数量
+// FreeList与SizeMap处于申请释放的快速路径，在头文件中内联定义
+// SizeMap为constexpr，对象大小在编译期已知时（如ConcurNew<T>）哈希桶下标在编译期算出
+
+// 在每个内存块（对象）头部存储指针，指针大小兼容32位和64位平台
+inline void*& FreeList::Next(void* obj) { return *(void**)obj; }
+
+inline void FreeList::Push(void* obj) {
+  assert(obj);
+  Next(obj) = _freeList;
+  _freeList = obj;
+  ++_size;
+}
+
+inline void* FreeList::Pop() {
+  assert(_freeList);
+  void* obj = _freeList;
+  _freeList = Next(obj);
+  --_size;
+  return obj;
+}
+
+inline bool FreeList::Empty() { return _freeList == nullptr; }
+
+inline size_t& FreeList::Size() { return _size; }
+
+inline size_t& FreeList::MaxSize() { return _maxSize; }
+
+inline size_t& FreeList::LowWater() { return _lowWater; }
+
+inline size_t& FreeList::Overages() { return _overages; }
+
+// 输入申请字节数，返回对齐字节数
+inline constexpr size_t SizeMap::RoundUp(size_t bytes) {
+  if (bytes <= 128) {
+    return _RoundUp(bytes, 8);
+  } else if (bytes <= 1024) {
+    return _RoundUp(bytes, 16);
+  } else if (bytes <= (8 << 10)) {
+    return _RoundUp(bytes, 128);
+  } else if (bytes <= (64 << 10)) {
+    return _RoundUp(bytes, 1024);
+  } else if (bytes <= (256 << 10)) {
+    return _RoundUp(bytes, 8 << 10);
+  } else {
+    return _RoundUp(bytes, 1 << PAGE_SHIFT);
+  }
+}
+
+// 输入申请字节数，返回对应哈希桶的下标索引
+inline constexpr size_t SizeMap::Index(size_t bytes) {
+  // 每个区间的桶数
+  const size_t groups[] = {16, 56, 56, 56};
+  // 传参时要减去前一个区间的最大字节数
+  if (bytes <= 128) {
+    return _Index(bytes, 3);
+  } else if (bytes <= 1024) {
+    return _Index(bytes - 128, 4) + groups[0];
+  } else if (bytes <= (8 << 10)) {
+    return _Index(bytes - 1024, 7) + groups[0] + groups[1];
+  } else if (bytes <= (64 << 10)) {
+    return _Index(bytes - (8 << 10), 10) + groups[0] + groups[1] + groups[2];
+  } else {
+    assert(bytes <= (256 << 10));
+    return _Index(bytes - (64 << 10), 13) + groups[0] + groups[1] + groups[2] + groups[3];
+  }
+}
+
+// 输入哈希桶的下标索引，返回对应的对齐字节数（Index的逆运算）
+inline constexpr size_t SizeMap::ClassSize(size_t index) {
+  if (index < 16) {
+    return (index + 1) << 3;
+  } else if (index < 72) {
+    return 128 + ((index - 16 + 1) << 4);
+  } else if (index < 128) {
+    return 1024 + ((index - 72 + 1) << 7);
+  } else if (index < 184) {
+    return (8 << 10) + ((index - 128 + 1) << 10);
+  } else {
+    assert(index < CLASS_NUM);
+    return (64 << 10) + ((index - 184 + 1) << 13);
+  }
+}
+
+// 位运算写法，较精妙（代入数字便于理解）
+inline constexpr size_t SizeMap::_RoundUp(size_t bytes, size_t alignNum) {
+  return (bytes + alignNum - 1) & ~(alignNum - 1);
+}
+
+// 计算当前区间的第几个桶
+inline constexpr size_t SizeMap::_Index(size_t bytes, size_t alignShift) {
+  return ((bytes + (1 << alignShift) - 1) >> alignShift) - 1;
+}
+
+// 统计末尾0的个数，即最低位1的下标
+static inline size_t CountTrailingZeros(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return index;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+// 位图Span的空闲对象位图，第i位置1表示第i个对象空闲，对象数超过SPAN_BITMAP_BITS的哈希桶仍用链表
+static const size_t SPAN_BITMAP_BITS = 512;
+struct SpanBitmap {
+  uint64_t _words[SPAN_BITMAP_BITS / 64];
+};
 
+// 以页为单位的连续大块内存
+// 按缓存行对齐，spanPool以64字节为步长分配，每个Span恰好占一个缓存行，热数据不会跨行
+struct alignas(CACHE_LINE_SIZE) Span {
+  // 热数据：对象申请释放路径（CentralCache）访问的字段，位于前32字节
+  union {
+    void* _freeList = nullptr;  // 链表Span：对象空闲链表
+    SpanBitmap* _bitmap;        // 位图Span：空闲对象位图，位于Span元数据中，不写入对象本身
+  };
   // 双向链表
   Span* _prev = nullptr;
   Span* _next = nullptr;
-
-  size_t _objSize = 0;        // 对象大小
-  size_t _useCount = 0;       // 对象分配数量
-  void* _freeList = nullptr;  // 对象空闲链表
-
-  bool _inUse = false;  // Span是否被使用
+  uint16_t _useCount = 0;   // 对象分配数量，一个Span最多1024个对象
+  uint8_t _sizeClass = 0;   // 哈希桶下标+1，0表示大块内存或空闲Span
+  uint8_t _shard = 0;       // 所属CentralCache哈希桶分片
+  bool _bitmapped = false;  // 空闲对象由_bitmap管理
+
+  // 冷数据：PageHeap合并与缓存使用的字段
+  uintptr_t _start = 0;     // 起始页号
+  uint32_t _size = 0;       // 页的数量，32位可表示32TB
+  uint32_t _idleTime = 0;   // 进入大块Span缓存的时间(ms)，按无符号差值比较，回绕不影响
+  bool _inUse = false;      // Span是否被使用，只有合并时读取
+  bool _zeroed = false;     // 页内容是否已知全零（刚从系统申请或已归还系统）
+
+  // 对象大小：小对象由哈希桶下标换算，大块内存即整个Span
+  size_t ObjSize() const {
+    return _sizeClass != 0 ? SizeMap::ClassSize(_sizeClass - 1) : (size_t)_size << PAGE_SHIFT;
+  }
 };
+static_assert(sizeof(Span) == CACHE_LINE_SIZE, "Span元数据应恰好占一个缓存行");
 
 #include "ObjectPool.hpp"
 static ObjectPool<Span> spanPool;
 
-// 以大块内存为单位的双向链表
-class SpanList {
+// 以大块内存为单位的双向链表，按缓存行对齐，避免相邻桶锁伪共享
+class alignas(CACHE_LINE_SIZE) SpanList {
  public:
   SpanList();
 
@@ -132,9 +395,11 @@ class SpanList {
 
   bool Empty();
 
-  std::mutex& Mutex();
+  ConcurMutex& Mutex();
+
+  size_t _emptyNum = 0;  // CentralCache中_useCount为0的Span数，受桶锁保护
 
  private:
-  Span* _head;        // 哨兵位
-  std::mutex _mutex;  // 桶锁
+  Span* _head;         // 哨兵位
+  ConcurMutex _mutex;  // 桶锁
 };
\ No newline at end of file
@@ -3,8 +3,213 @@
 #include "PageHeap.h"
 #include "ThreadCache.h"
 
+// 慢路径：创建线程缓存、大块内存的申请与释放，不内联
+CONCUR_COLD void* ConcurAllocSlow(size_t bytes);
+CONCUR_COLD void ConcurFreeSlow(void* ptr, size_t sizeClass);
+
 // 对外申请内存接口（代替malloc）
-void* ConcurAlloc(size_t bytes);
+// 快速路径在头文件中内联：开始操作、读TLS、计算哈希桶、从自由链表弹出
+inline void* ConcurAlloc(size_t bytes) {
+  if (CONCUR_LIKELY(bytes <= MAX_BYTES)) {
+    ThreadCache::BeginOp();
+    ThreadCache* cache = pThreadCache.load(std::memory_order_relaxed);
+    if (CONCUR_LIKELY(cache != nullptr)) {
+      return cache->Allocate(bytes);
+    }
+    ThreadCache::EndOp();
+  }
+  return ConcurAllocSlow(bytes);
+}
 
 // 对外释放内存接口（代替free）
-void ConcurFree(void* ptr);
\ No newline at end of file
+// 快速路径在头文件中内联：由页号查到哈希桶、压入自由链表，无需访问Span
+inline void ConcurFree(void* ptr) {
+  assert(ptr);
+  size_t sizeClass = PageHeap::Instance().ObjectToSizeClass(ptr);
+  if (CONCUR_LIKELY(sizeClass != 0)) {
+    ThreadCache::BeginOp();
+    ThreadCache* cache = pThreadCache.load(std::memory_order_relaxed);
+    if (CONCUR_LIKELY(cache != nullptr)) {
+      cache->DeallocateIndex(ptr, sizeClass - 1);
+      return;
+    }
+    ThreadCache::EndOp();
+  }
+  ConcurFreeSlow(ptr, sizeClass);
+}
+
+// 申请独占缓存行的内存：大小向上取整到缓存行，对应哈希桶的对象大小也是缓存行的整数倍，
+// 而Span按页对齐，所以对象起止都在缓存行边界上，不同线程的对象不会伪共享，用ConcurFree释放
+inline void* ConcurAllocIsolated(size_t bytes) {
+  return ConcurAlloc(bytes == 0 ? CACHE_LINE_SIZE
+                                : (bytes + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+}
+
+// 编译期已知大小的申请与释放：哈希桶下标在编译期算出，释放时不查页映射
+// 只能释放同样由ConcurAllocFixed<BYTES>申请的内存
+template <size_t BYTES>
+inline void* ConcurAllocFixed() {
+  if constexpr (BYTES <= MAX_BYTES) {
+    constexpr size_t index = SizeMap::Index(BYTES == 0 ? 1 : BYTES);
+    ThreadCache::BeginOp();
+    ThreadCache* cache = pThreadCache.load(std::memory_order_relaxed);
+    if (CONCUR_LIKELY(cache != nullptr)) {
+      return cache->AllocateIndex(index);
+    }
+    ThreadCache::EndOp();
+  }
+  return ConcurAllocSlow(BYTES);
+}
+
+template <size_t BYTES>
+inline void ConcurFreeFixed(void* ptr) {
+  assert(ptr);
+  if constexpr (BYTES <= MAX_BYTES) {
+    constexpr size_t index = SizeMap::Index(BYTES == 0 ? 1 : BYTES);
+    assert(PageHeap::Instance().ObjectToSizeClass(ptr) == index + 1);
+    ThreadCache::BeginOp();
+    ThreadCache* cache = pThreadCache.load(std::memory_order_relaxed);
+    if (CONCUR_LIKELY(cache != nullptr)) {
+      cache->DeallocateIndex(ptr, index);
+      return;
+    }
+    ThreadCache::EndOp();
+    ConcurFreeSlow(ptr, index + 1);
+  } else {
+    ConcurFreeSlow(ptr, 0);
+  }
+}
+
+// 对外的类型化申请接口（代替new），构造函数抛出异常时归还内存
+// 哈希桶按对象大小对齐（8、16字节或更大），不支持更严格的对齐要求
+template <class T, class... Args>
+inline T* ConcurNew(Args&&... args) {
+  static_assert(alignof(T) <= 16, "ConcurNew不支持超过16字节的对齐");
+  void* ptr = ConcurAllocFixed<sizeof(T)>();
+  try {
+    return new (ptr) T(std::forward<Args>(args)...);
+  } catch (...) {
+    ConcurFreeFixed<sizeof(T)>(ptr);
+    throw;
+  }
+}
+
+// 对外的类型化释放接口（代替delete），ptr须由ConcurNew<T>申请，且T为其实际类型
+template <class T>
+inline void ConcurDelete(T* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  ptr->~T();
+  ConcurFreeFixed<sizeof(T)>((void*)ptr);
+}
+
+// 在类定义中使用，为类T提供经由内存池的operator new/delete
+// 大小等于sizeof(T)时走编译期哈希桶下标的路径，派生类等其他大小退回ConcurAlloc/ConcurFree
+#define CONCUR_POOLED(T)                                              \
+  static void* operator new(size_t bytes) {                           \
+    return bytes == sizeof(T) ? ConcurAllocFixed<sizeof(T)>()         \
+                              : ConcurAlloc(bytes);                   \
+  }                                                                   \
+  static void operator delete(void* ptr, size_t bytes) {              \
+    if (ptr == nullptr) {                                             \
+      return;                                                         \
+    }                                                                 \
+    if (bytes == sizeof(T)) {                                         \
+      ConcurFreeFixed<sizeof(T)>(ptr);                                \
+    } else {                                                          \
+      ConcurFree(ptr);                                                \
+    }                                                                 \
+  }
+
+// 指针是否由内存池分配，与malloc混用时据此决定由谁释放
+// 预留地址模式（CONCUR_ARENA_BITS）下只比较地址范围，任意内部地址都可判断；
+// 否则查一次页映射，只对ConcurAlloc返回的起始指针有定义：超过1024KB的大块内存只标记首尾页，
+// 内部地址可能命中已失效的映射，返回true或false都有可能
+inline bool ConcurOwns(const void* ptr) { return PageHeap::Instance().Owns(ptr); }
+
+// 对外申请清零内存接口（代替calloc）
+void* ConcurCalloc(size_t num, size_t size);
+
+// 对外重新分配内存接口（代替realloc）
+void* ConcurRealloc(void* ptr, size_t bytes);
+
+// 设置大块内存（超过1024KB）缓存的字节上限，0表示不缓存
+void ConcurSetLargeCacheLimit(size_t bytes);
+
+// 设置已提交内存的软上限与硬上限，0表示不限制
+// 超过软上限时先请求清空线程缓存并归还回到软上限以下所需的空闲页，超过硬上限时分配失败
+void ConcurSetMemoryLimit(size_t softBytes, size_t hardBytes);
+
+// 设置超过硬上限时调用的处理函数，nullptr表示直接抛出std::bad_alloc
+void ConcurSetLimitHandler(LimitHandler handler);
+
+// 获取页堆内存统计与上限命中次数
+HeapStats ConcurGetHeapStats();
+
+// 将当前线程缓存的全部对象归还CentralCache
+void ConcurThreadCacheFlush();
+
+// 清空所有线程缓存：不在申请释放中的线程（如休眠的线程池线程）的缓存由调用线程直接归还，
+// 其余线程在下一次申请或释放时自行清空
+void ConcurThreadCacheFlushAll();
+
+// 设置线程缓存的闲置时长，超过该时长没有任何申请释放的线程缓存由其他线程取走归还，0表示不启用
+// 线程退出时其缓存总会被归还
+void ConcurSetThreadCacheDecay(size_t ms);
+
+// 设置CentralCache每个分片保留的完全空闲Span数，超出的归还页堆，0表示立即归还
+void ConcurSetEmptySpanLimit(size_t spans);
+
+// 设置当前线程是否异步释放（默认关闭），适合对释放延迟敏感的线程（如网络I/O线程）
+// 开启后线程缓存归还CentralCache的批量对象与大块内存交给后台回收线程，本线程不再加桶锁、页堆锁，
+// 也不会在释放时合并页或munmap；每个线程的队列容量有限，队列满时退回同步释放
+void ConcurSetAsyncFree(bool enable);
+
+// 当前线程因异步释放队列满而同步释放的次数
+size_t ConcurAsyncFreeFallbacks();
+
+// 基于纪元的延迟回收，供无锁数据结构使用：读取共享结点前进入临界区，读完退出（可嵌套）；
+// 结点从结构中摘下后调用ConcurRetire代替ConcurFree，等所有线程都退出可能读到它的临界区后才放回
+// 当前线程的自由链表。待回收对象借用头部8字节串成链表，不另外申请结点，退休后头部内容不再有效
+void ConcurEpochEnter();
+void ConcurEpochExit();
+void ConcurRetire(void* ptr);
+
+// 尝试推进全局纪元并释放当前线程已安全的退休对象，返回仍在等待的对象数
+// 线程退出前可循环调用直到返回0，否则其退休对象不会再被释放
+size_t ConcurEpochReclaim();
+
+// 临界区守卫，构造时进入、析构时退出
+class ConcurEpochGuard {
+ public:
+  ConcurEpochGuard() { ConcurEpochEnter(); }
+  ~ConcurEpochGuard() { ConcurEpochExit(); }
+  ConcurEpochGuard(const ConcurEpochGuard&) = delete;
+  ConcurEpochGuard& operator=(const ConcurEpochGuard&) = delete;
+};
+
+// 设置新申请的小对象Span是否用位图管理空闲对象（默认启用），已有的Span保持原来的形式
+// 位图位于Span元数据中，CentralCache取出与归还对象时不在对象内写链表指针；每个Span超过512个对象的哈希桶（8字节）始终用链表
+void ConcurSetBitmapSpans(bool enable);
+
+// 预先向系统映射bytes字节挂入页堆，之后的申请无需mmap；populate时预先触发缺页，
+// lock时锁定在物理内存中。预留的内存不会因闲置归还系统，超过硬上限或系统调用失败时返回false
+bool ConcurReserve(size_t bytes, bool populate = true, bool lock = false);
+
+// 预热配置：每个大小预先缓存的对象数
+struct PrewarmEntry {
+  size_t _bytes;
+  size_t _count;
+};
+
+// 为当前线程预先缓存profile中各大小的对象（每个大小最多缓存MAX_LIST_BATCHES批），并跳过慢启动
+// 对象取自CentralCache，不足时由其向页堆申请Span；需要预热的工作线程各自调用
+void ConcurPrewarm(const PrewarmEntry* profile, size_t n);
+
+// 汇总所有线程（含已退出线程）经过各路径的次数，按AllocPath下标
+// 计数由各线程自行累加，不加锁也不用原子加法，汇总时其他线程仍在运行则结果只是近似快照
+PathStats ConcurGetPathStats();
+
+// 打印PageHeap锁与CentralCache各哈希桶锁的竞争统计（需编译时定义CONCUR_LOCK_PROFILE）
+void ConcurDumpLockProfile();
\ No newline at end of file
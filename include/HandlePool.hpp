@@ -0,0 +1,109 @@
+#pragma once
+#include "Common.h"
+
+// 以32位句柄代替指针的定长内存池，适合图、字典树等指针密集的结构，结点中的引用只占4字节
+// 对象位于一段启动时预留的连续虚拟地址中，按需提交，增长时不搬移已有对象，句柄即对象下标，
+// Resolve只需一次乘加。与ObjectPool相同，释放的对象头部存储下一个空闲句柄串成链表复用，
+// 申请与释放加锁，可并发调用
+template <class T>
+class HandlePool {
+ public:
+  typedef uint32_t Handle;
+  static constexpr Handle NULL_HANDLE = 0;  // 下标0不分配，作为空句柄
+
+  // 预留maxObjects个对象的地址空间，只占虚拟地址，不占物理内存；按实际需要给出上限，
+  // 上限为UINT32_MAX时12字节的结点就要预留48GB地址，几个这样的池即可耗尽47位用户地址空间
+  explicit HandlePool(size_t maxObjects) {
+    assert(maxObjects > 1 && maxObjects <= UINT32_MAX);
+    _maxObjects = maxObjects;
+    _reservedBytes = RoundUpPages(maxObjects * OBJ_SIZE);
+    _base = (char *)SystemAllocator::Reserve(_reservedBytes);
+  }
+
+  // 归还整段地址，不调用仍存活对象的析构函数，之后其句柄全部失效
+  ~HandlePool() { SystemAllocator::Free(_base, _reservedBytes); }
+
+  HandlePool(const HandlePool &) = delete;
+  HandlePool &operator=(const HandlePool &) = delete;
+
+  // 申请一个对象并以args构造，返回其句柄，地址空间用尽时抛出std::bad_alloc
+  template <class... Args>
+  Handle New(Args &&...args) {
+    Handle handle = NULL_HANDLE;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_freeList != NULL_HANDLE) {  // 利用空闲回收对象
+        handle = _freeList;
+        _freeList = NextFree(handle);
+      } else {  // 利用未使用的下标，已提交部分用完时再提交一段
+        if (_top == _maxObjects) {
+          throw std::bad_alloc();
+        }
+        size_t end = (_top + 1) * OBJ_SIZE;
+        if (end > _committedBytes) {
+          size_t bytes = std::min(RoundUpPages(std::max(end - _committedBytes, COMMIT_BYTES)),
+                                  _reservedBytes - _committedBytes);
+          if (!SystemAllocator::Commit(_base + _committedBytes, bytes)) {
+            throw std::bad_alloc();
+          }
+          _committedBytes += bytes;
+        }
+        handle = (Handle)_top++;
+      }
+    }
+
+    try {
+      new (Resolve(handle)) T(std::forward<Args>(args)...);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      NextFree(handle) = _freeList;
+      _freeList = handle;
+      throw;
+    }
+    return handle;
+  }
+
+  // 析构并回收对象，句柄随后可能被再次分配
+  void Delete(Handle handle) {
+    assert(handle != NULL_HANDLE);
+    Resolve(handle)->~T();
+
+    // 在回收对象的头部存储下一个空闲句柄，将所有回收对象链接起来
+    std::lock_guard<std::mutex> lock(_mutex);
+    assert(handle < _top);
+    NextFree(handle) = _freeList;
+    _freeList = handle;
+  }
+
+  // 句柄换算为地址，对象不会搬移，地址在释放前一直有效
+  T *Resolve(Handle handle) const {
+    assert(handle != NULL_HANDLE);
+    return reinterpret_cast<T *>(_base + (size_t)handle * OBJ_SIZE);
+  }
+
+  // 已提交的字节数
+  size_t CommittedBytes() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _committedBytes;
+  }
+
+ private:
+  // 对象至少能存下一个空闲句柄，并保持T的对齐
+  static constexpr size_t OBJ_SIZE =
+      (std::max(sizeof(T), sizeof(Handle)) + alignof(T) - 1) & ~(alignof(T) - 1);
+  static constexpr size_t COMMIT_BYTES = 16 << PAGE_SHIFT;  // 每次至少提交16页
+
+  static size_t RoundUpPages(size_t bytes) {
+    return (bytes + ((size_t)1 << PAGE_SHIFT) - 1) & ~(((size_t)1 << PAGE_SHIFT) - 1);
+  }
+  Handle &NextFree(Handle handle) const { return *reinterpret_cast<Handle *>(Resolve(handle)); }
+
+ private:
+  char *_base = nullptr;         // 预留地址的起始
+  size_t _maxObjects = 0;        // 最多分配的下标数（含空句柄）
+  size_t _reservedBytes = 0;     // 预留的字节数
+  size_t _committedBytes = 0;    // 已提交的字节数
+  size_t _top = 1;               // 下一个从未分配过的下标
+  Handle _freeList = NULL_HANDLE;  // 回收对象的句柄链表
+  std::mutex _mutex;
+};
@@ -24,7 +24,8 @@ class ObjectPool {
       }
 
       obj = (T *)_memory;
-      // 保证分配内存大小能存储指针
+      // 保证分配内存大小能存储指针；sizeof(T)是alignof(T)的整数倍，申请的页对齐，
+      // 按sizeof(T)步进即保持T的对齐（如按缓存行对齐的Span）
       size_t objSize = sizeof(T) > sizeof(void *) ? sizeof(T) : sizeof(void *);
       _memory += objSize;
       _remainBytes -= objSize;
@@ -50,3 +51,44 @@ class ObjectPool {
   void *_freeList = nullptr;  // 回收内存
   std::mutex _mutex;
 };
+
+// 适配STL容器的分配器，每次只分配一个结点，结点内存来自定长内存池
+// 避免PageHeap等内部结构经由malloc申请内存
+template <class T>
+class PoolAllocator {
+ public:
+  typedef T value_type;
+
+  PoolAllocator() = default;
+  template <class U>
+  PoolAllocator(const PoolAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    assert(n == 1);
+    return reinterpret_cast<T *>(Pool().New());
+  }
+
+  void deallocate(T *ptr, size_t n) {
+    assert(n == 1);
+    Pool().Delete(reinterpret_cast<Block *>(ptr));
+  }
+
+  template <class U>
+  bool operator==(const PoolAllocator<U> &) const {
+    return true;
+  }
+  template <class U>
+  bool operator!=(const PoolAllocator<U> &) const {
+    return false;
+  }
+
+ private:
+  struct Block {
+    alignas(T) char _data[sizeof(T)];
+  };
+
+  static ObjectPool<Block> &Pool() {
+    static ObjectPool<Block> pool;
+    return pool;
+  }
+};
@@ -1,7 +1,21 @@
 #pragma once
+#include <set>
+
 #include "Common.h"
 #include "PageMap.hpp"
 
+// 页堆内存统计
+struct HeapStats {
+  size_t _mappedBytes = 0;     // 向系统映射的字节数
+  size_t _committedBytes = 0;  // 映射中可能占用物理内存的字节数（不含已知全零的空闲页）
+  size_t _softLimitHits = 0;   // 超过软上限的次数
+  size_t _hardLimitHits = 0;   // 超过硬上限而分配失败的次数
+  size_t _mapFailures = 0;     // 未超过上限但向系统映射失败的次数
+};
+
+// 超过硬上限时调用的处理函数，返回true表示已释放内存、重试分配，返回false则抛出std::bad_alloc
+typedef bool (*LimitHandler)(size_t bytes);
+
 // 单例模式 -- 懒汉式
 class PageHeap {
  public:
@@ -11,20 +25,127 @@ class PageHeap {
     return instance;
   }
 
-  // 与CentralCache交互
+  // 与CentralCache交互，超过硬上限或系统内存不足时返回nullptr
   Span* New(size_t pages);
   void Delete(Span* span);
+  // 原地扩展一个使用中的Span到pages页，失败返回false
+  bool Grow(Span* span, size_t pages);
 
+  // 对象所属的Span。超过PAGE_NUM页的Span只标记首尾页，内部页可能残留已失效的映射，
+  // 大块内存须传入起始指针
   Span* ObjectToSpan(void* obj);
-  std::mutex& Mutex();
+  // 指针是否属于页堆：预留地址模式下只比较地址范围，任意地址都可判断；否则查页映射，
+  // 只对起始指针有定义，大块内存的内部地址可能残留旧映射，结果不确定
+  bool Owns(const void* ptr) const {
+#ifdef CONCUR_ARENA_BITS
+    return _idSpanMap.Contains((uintptr_t)ptr >> PAGE_SHIFT);
+#else
+    return _idSpanMap.get((uintptr_t)ptr >> PAGE_SHIFT) != nullptr;
+#endif
+  }
+  // 记录小对象Span每一页的哈希桶下标，释放时无需访问Span
+  void SetSizeClass(Span* span, size_t index);
+  // 返回对象所属页的哈希桶下标+1，0表示不是小对象
+  size_t ObjectToSizeClass(void* obj) { return _classMap.get((uintptr_t)obj >> PAGE_SHIFT); }
+  ConcurMutex& Mutex();
+
+  // 设置超过PAGE_NUM页的空闲Span占用物理内存的字节上限，0表示立即归还系统
+  void SetLargeCacheLimit(size_t bytes);
+  // 预先向系统映射bytes字节并挂入空闲结构，populate时预先触发缺页，lock时锁定在物理内存中
+  // 预留的字节数作为大块Span缓存的下限，不会因闲置被归还（超过软上限时除外）
+  // 超过硬上限或映射失败返回false，预填充或锁定失败时内存仍已预留，也返回false
+  bool Reserve(size_t bytes, bool populate, bool lock);
+  // 统计长度不小于minPages的空闲Span的总页数
+  size_t FreePages(size_t minPages = 1);
+  // 不持有页堆锁时调用，锁空闲时归还闲置过久的大块空闲Span，使不再申请释放大块内存的进程也能归还
+  void ScavengeIdle();
+
+  // 设置已提交内存的软上限与硬上限，0表示不限制
+  void SetLimits(size_t softBytes, size_t hardBytes);
+  void SetLimitHandler(LimitHandler handler);
+  HeapStats Stats();
+  // New返回nullptr后在锁外调用：释放了异步释放队列中的内存、归还了CentralCache保留的空闲Span
+  // 或处理函数返回true时返回，否则抛出std::bad_alloc
+  void HandleLimit(size_t bytes);
 
  private:
-  PageHeap() : _idSpanMap(SystemAllocator::Alloc) {}
+#ifdef CONCUR_ARENA_BITS
+  // 先预留整段地址，页映射以其起始页号为基准
+  PageHeap()
+      : _arenaBase((uintptr_t)SystemAllocator::Reserve((size_t)1 << ARENA_BITS)),
+        _arenaTop(_arenaBase),
+        _idSpanMap(SystemAllocator::Alloc, _arenaBase >> PAGE_SHIFT),
+        _classMap(SystemAllocator::Alloc, _arenaBase >> PAGE_SHIFT) {}
+#else
+  PageHeap() : _idSpanMap(SystemAllocator::Alloc), _classMap(SystemAllocator::Alloc) {}
+#endif
   PageHeap(const PageHeap&) = delete;
   PageHeap& operator=(const PageHeap&) = delete;
 
+  // 向系统申请bytes字节：预留地址模式下从预留区间顶部切出并提交，否则直接映射，失败抛出std::bad_alloc
+  void* SystemAlloc(size_t bytes);
+  void MapSpan(Span* span);
+  void Merge(Span* span);
+  // 空闲Span的插入、移除与最佳适配查找
+  void InsertFree(Span* span);
+  void RemoveFree(Span* span);
+  Span* FindFree(size_t pages);
+  // 从空闲Span头部切出pages页
+  Span* Carve(Span* span, size_t pages);
+  // 超出上限时从闲置最久的大块空闲Span开始归还系统，闲置过久的检查每LARGE_SCAVENGE_MS最多一次。
+  // 在大块内存的申请释放与调整上限时调用，此外线程缓存的闲置检查经ScavengeIdle驱动；
+  // 两者都不再发生（进程不再申请释放任何内存）时空闲Span保持原样
+  void ScavengeLargeSpans();
+  // 归还span的物理页，span须在空闲结构中
+  void ReleaseFree(Span* span);
+  // 再映射bytes字节前检查上限，每次请求最多调用一次：超过软上限时请求清空线程缓存与
+  // CentralCache保留的空闲Span，并归还回到软上限以下所需的空闲页，超过硬上限返回false
+  bool ReserveBytes(size_t bytes);
+  // 归还空闲页直到已提交字节数不超过target
+  void ReleaseFreeTo(size_t target);
+  size_t Committed() const { return _stats._mappedBytes - _zeroBytes; }
+  bool WithinHardLimit(size_t bytes) const {
+    return _hardLimit == 0 || Committed() + bytes <= _hardLimit;
+  }
+
+  // 大块空闲Span按(页数,起始页号)排序，lower_bound即为最低地址的最佳适配
+  struct SpanBestFit {
+    bool operator()(const Span* left, const Span* right) const {
+      if (left->_size != right->_size) {
+        return left->_size < right->_size;
+      }
+      return left->_start < right->_start;
+    }
+  };
+  typedef std::set<Span*, SpanBestFit, PoolAllocator<Span*>> SpanSet;
+
+  static const size_t BITMAP_WORDS = PAGE_NUM / 64 + 1;
+
  private:
-  SpanList _spanLists[PAGE_NUM + 1];
-  PageMap3<ADDRESS_BITS - PAGE_SHIFT> _idSpanMap;  //<页号,Span*>
-  std::mutex _mutex;
-};
\ No newline at end of file
+  SpanList _spanLists[PAGE_NUM + 1];    // [1,PAGE_NUM]页的空闲Span，按页数精确分桶
+  uint64_t _spanBitmap[BITMAP_WORDS] = {};  // 标记非空的_spanLists
+  SpanSet _largeSpans;                  // 超过PAGE_NUM页的空闲Span
+  SpanList _largeIdle;                  // 其中尚未归还系统的Span，按_idleTime排列，头部最新
+  uint32_t _nextScavengeMs = 0;         // 下一次检查闲置时间的时刻
+  size_t _largeBytes = 0;               // _largeSpans中尚未归还系统的字节数
+  size_t _largeLimit = LARGE_CACHE_BYTES;
+  size_t _reservedBytes = 0;            // Reserve预留的字节数，大块Span缓存不低于该值
+  size_t _zeroBytes = 0;                // 空闲结构中已知全零（未占用物理内存）的字节数
+  size_t _softLimit = 0;
+  size_t _hardLimit = 0;
+  bool _aboveSoftLimit = false;         // 上一次检查时是否超过软上限
+  uint32_t _nextSoftReleaseMs = 0;      // 超过软上限期间下一次允许归还空闲页的时刻
+  HeapStats _stats;
+  std::atomic<LimitHandler> _limitHandler{nullptr};
+
+#ifdef CONCUR_ARENA_BITS
+  uintptr_t _arenaBase;  // 预留地址的起始地址
+  uintptr_t _arenaTop;   // 已提交部分的末尾，之后的地址尚未提交
+  ArenaPageMap<ARENA_BITS - PAGE_SHIFT> _idSpanMap;           //<页号,Span*>
+  ArenaPageMap<ARENA_BITS - PAGE_SHIFT, uint8_t> _classMap;   //<页号,哈希桶下标+1>
+#else
+  PageMap<VA_BITS - PAGE_SHIFT> _idSpanMap;          //<页号,Span*>
+  PageMap<VA_BITS - PAGE_SHIFT, uint8_t> _classMap;  //<页号,哈希桶下标+1>，每页一字节
+#endif
+  ConcurMutex _mutex;
+};
@@ -1,19 +1,30 @@
+#pragma once
+#include <type_traits>
+
 #include "Common.h"
 
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#define PAGEMAP_PREFETCH(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define PAGEMAP_PREFETCH(addr) __builtin_prefetch(addr)
+#endif
+
 // Single-level array
-template <int BITS>
+// T is the value type stored per key (void* by default, or e.g. a byte)
+template <int BITS, class T = void*>
 class PageMap1 {
  private:
   static const int LENGTH = 1 << BITS;
 
-  void** _array;
+  T* _array;
 
  public:
   typedef uintptr_t Number;
 
   explicit PageMap1(void* (*allocator)(size_t)) {
-    _array = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
-    memset(_array, 0, sizeof(void*) << BITS);
+    _array = reinterpret_cast<T*>((*allocator)(sizeof(T) << BITS));
+    memset(_array, 0, sizeof(T) << BITS);
   }
 
   // Ensure that the map contains initialized entries "x .. x+n-1".
@@ -30,32 +41,39 @@ class PageMap1 {
 
   // Return the current value for KEY.  Returns nullptr if not yet
   // set, or if k is out of range.
-  void* get(Number k) const {
+  T get(Number k) const {
     if ((k >> BITS) > 0) {
-      return nullptr;
+      return T();
     }
     return _array[k];
   }
 
+  // Prefetch the entry for KEY so that a later get() hits the cache.
+  void Prefetch(Number k) const {
+    if ((k >> BITS) == 0) {
+      PAGEMAP_PREFETCH(&_array[k]);
+    }
+  }
+
   // REQUIRES "k" is in range "[0,2^BITS-1]".
   // REQUIRES "k" has been ensured before.
   //
   // Sets the value 'v' for key 'k'.
-  void set(Number k, void* v) { _array[k] = v; }
+  void set(Number k, T v) { _array[k] = v; }
 
   // Return the first non-nullptr pointer found in this map for a page
   // number >= k.  Returns nullptr if no such number is found.
-  void* Next(Number k) const {
+  T Next(Number k) const {
     while (k < (1 << BITS)) {
-      if (_array[k] != nullptr) return _array[k];
+      if (_array[k] != T()) return _array[k];
       k++;
     }
-    return nullptr;
+    return T();
   }
 };
 
 // Two-level radix tree
-template <int BITS>
+template <int BITS, class T = void*>
 class PageMap2 {
  private:
   static const int LEAF_BITS = (BITS + 1) / 2;
@@ -66,7 +84,7 @@ class PageMap2 {
 
   // Leaf node
   struct Leaf {
-    void* values[LEAF_LENGTH];
+    T values[LEAF_LENGTH];
   };
 
   Leaf* _root[ROOT_LENGTH];     // Pointers to child nodes
@@ -80,16 +98,24 @@ class PageMap2 {
     memset(_root, 0, sizeof(_root));
   }
 
-  void* get(Number k) const {
+  T get(Number k) const {
     const Number i1 = k >> LEAF_BITS;
     const Number i2 = k & (LEAF_LENGTH - 1);
     if ((k >> BITS) > 0 || _root[i1] == nullptr) {
-      return nullptr;
+      return T();
     }
     return _root[i1]->values[i2];
   }
 
-  void set(Number k, void* v) {
+  void Prefetch(Number k) const {
+    const Number i1 = k >> LEAF_BITS;
+    const Number i2 = k & (LEAF_LENGTH - 1);
+    if ((k >> BITS) == 0 && _root[i1] != nullptr) {
+      PAGEMAP_PREFETCH(&_root[i1]->values[i2]);
+    }
+  }
+
+  void set(Number k, T v) {
     const Number i1 = k >> LEAF_BITS;
     const Number i2 = k & (LEAF_LENGTH - 1);
     assert(i1 < ROOT_LENGTH);
@@ -128,14 +154,14 @@ class PageMap2 {
     }
   }
 
-  void* Next(Number k) const {
+  T Next(Number k) const {
     while (k < (Number(1) << BITS)) {
       const Number i1 = k >> LEAF_BITS;
       Leaf* leaf = _root[i1];
       if (leaf != nullptr) {
         // Scan forward in leaf
         for (Number i2 = k & (LEAF_LENGTH - 1); i2 < LEAF_LENGTH; i2++) {
-          if (leaf->values[i2] != nullptr) {
+          if (leaf->values[i2] != T()) {
             return leaf->values[i2];
           }
         }
@@ -143,12 +169,12 @@ class PageMap2 {
       // Skip to next top-level entry
       k = (i1 + 1) << LEAF_BITS;
     }
-    return nullptr;
+    return T();
   }
 };
 
 // Three-level radix tree
-template <int BITS>
+template <int BITS, class T = void*>
 class PageMap3 {
  private:
   // How many bits should we consume at each interior level
@@ -166,7 +192,7 @@ class PageMap3 {
 
   // Leaf node
   struct Leaf {
-    void* values[LEAF_LENGTH];
+    T values[LEAF_LENGTH];
   };
 
   Node _root;                   // Root of radix tree
@@ -188,17 +214,26 @@ class PageMap3 {
     memset(&_root, 0, sizeof(_root));
   }
 
-  void* get(Number k) const {
+  T get(Number k) const {
     const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
     const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
     const Number i3 = k & (LEAF_LENGTH - 1);
     if ((k >> BITS) > 0 || _root.ptrs[i1] == nullptr || _root.ptrs[i1]->ptrs[i2] == nullptr) {
-      return nullptr;
+      return T();
     }
     return reinterpret_cast<Leaf*>(_root.ptrs[i1]->ptrs[i2])->values[i3];
   }
 
-  void set(Number k, void* v) {
+  void Prefetch(Number k) const {
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+    const Number i3 = k & (LEAF_LENGTH - 1);
+    if ((k >> BITS) == 0 && _root.ptrs[i1] != nullptr && _root.ptrs[i1]->ptrs[i2] != nullptr) {
+      PAGEMAP_PREFETCH(&reinterpret_cast<Leaf*>(_root.ptrs[i1]->ptrs[i2])->values[i3]);
+    }
+  }
+
+  void set(Number k, T v) {
     assert(k >> BITS == 0);
     const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
     const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
@@ -241,7 +276,7 @@ class PageMap3 {
 
   void PreallocateMoreMemory() {}
 
-  void* Next(Number k) const {
+  T Next(Number k) const {
     while (k < (Number(1) << BITS)) {
       const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
       const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
@@ -252,7 +287,7 @@ class PageMap3 {
         Leaf* leaf = reinterpret_cast<Leaf*>(_root.ptrs[i1]->ptrs[i2]);
         if (leaf != nullptr) {
           for (Number i3 = (k & (LEAF_LENGTH - 1)); i3 < LEAF_LENGTH; i3++) {
-            if (leaf->values[i3] != nullptr) {
+            if (leaf->values[i3] != T()) {
               return leaf->values[i3];
             }
           }
@@ -261,6 +296,62 @@ class PageMap3 {
         k = ((k >> LEAF_BITS) + 1) << LEAF_BITS;
       }
     }
-    return nullptr;
+    return T();
   }
-};
\ No newline at end of file
+};
+
+// Flat array over one reserved address range.  Keys are absolute page
+// numbers; the base page is subtracted so the array covers only the range,
+// and any key outside it (a key below the base wraps around) reads as empty.
+// The array is sized for the whole range, so unlike PageMap1 it is not
+// cleared: the allocator must return zero-filled memory (fresh mmap pages),
+// which keeps untouched entries free of physical memory.
+template <int BITS, class T = void*>
+class ArenaPageMap {
+ private:
+  T* _array;
+  uintptr_t _basePage;
+
+ public:
+  typedef uintptr_t Number;
+
+  ArenaPageMap(void* (*allocator)(size_t), Number basePage) : _basePage(basePage) {
+    _array = reinterpret_cast<T*>((*allocator)(sizeof(T) << BITS));
+  }
+
+  bool Ensure(Number k, size_t n) {
+    return Contains(k) && n <= (Number(1) << BITS) - (k - _basePage);
+  }
+
+  T get(Number k) const {
+    k -= _basePage;
+    if ((k >> BITS) > 0) {
+      return T();
+    }
+    return _array[k];
+  }
+
+  void Prefetch(Number k) const {
+    k -= _basePage;
+    if ((k >> BITS) == 0) {
+      PAGEMAP_PREFETCH(&_array[k]);
+    }
+  }
+
+  // REQUIRES "k" is inside the range.
+  void set(Number k, T v) {
+    assert(Contains(k));
+    _array[k - _basePage] = v;
+  }
+
+  // Range compare: true iff page k lies inside the reserved range.
+  bool Contains(Number k) const { return ((k - _basePage) >> BITS) == 0; }
+};
+
+// Select the map at compile time from the number of page-number bits:
+// a flat array when it stays small (32-bit platforms), a two-level tree for
+// 48-bit virtual addresses (1MB root, one dependent load less), otherwise three levels.
+template <int BITS, class T = void*>
+using PageMap = typename std::conditional<
+    (BITS <= 20), PageMap1<BITS, T>,
+    typename std::conditional<(BITS <= 36), PageMap2<BITS, T>, PageMap3<BITS, T>>::type>::type;
@@ -0,0 +1,66 @@
+#pragma once
+#include "Common.h"
+
+#ifdef __linux__
+#include <pthread.h>
+
+// 多进程共享的页堆：页来自memfd，各进程映射在同一地址，指针可直接在进程间传递
+// 控制块、每页元数据与空闲链表都位于共享区域内，由进程间共享的互斥锁保护，
+// 一个进程申请的内存可由另一个进程释放。以页为单位分配，适合在进程间零拷贝传递大块消息
+//
+// 共享区域布局：[SharedHeap控制块][PageInfo数组]...按页对齐...[数据页]
+class SharedHeap {
+ public:
+  // 创建共享堆，bytes向上取整到页，fd非空时返回memfd（未设置CLOEXEC，可经fork/exec继承）
+  // 失败返回nullptr
+  static SharedHeap* Create(const char* name, size_t bytes, int* fd = nullptr);
+  // 通过fd（经继承或SCM_RIGHTS传递）在当前进程映射到创建者的地址，地址已被占用时返回nullptr
+  static SharedHeap* Attach(int fd);
+  // 解除当前进程的映射，不关闭fd，共享堆中的内存不受影响
+  static void Detach(SharedHeap* heap);
+
+  // 申请至少bytes字节，按页对齐，空间不足或共享堆已损坏时返回nullptr
+  void* Alloc(size_t bytes);
+  // 释放任一进程申请的内存，与相邻空闲块合并；共享堆已损坏时不做任何修改并返回false
+  bool Free(void* ptr);
+
+  bool Contains(const void* ptr) const;
+  // 统计空闲页数，共享堆已损坏时返回0
+  size_t FreePages();
+  // 曾有进程在持锁修改元数据时退出，空闲链表与边界标记可能只改了一半，之后所有申请与释放都失败
+  bool Poisoned() const { return __atomic_load_n(&_poisoned, __ATOMIC_ACQUIRE) != 0; }
+
+ private:
+  // 每页一个元数据，连续页组成的块只在首页与尾页记录页数（边界标记），释放时据此找到相邻块
+  struct PageInfo {
+    uint32_t _size;  // 块的页数
+    uint32_t _free;  // 块是否空闲
+    uint32_t _prev;  // 空闲块在空闲链表中的前驱与后继页号，NONE表示没有
+    uint32_t _next;
+  };
+  static const uint32_t NONE = UINT32_MAX;
+  static const uint64_t MAGIC = 0x434f4e435552534dULL;  // "CONCURSM"
+
+  SharedHeap() = delete;
+
+  PageInfo* Pages() { return reinterpret_cast<PageInfo*>(this + 1); }
+  // 加锁，共享堆已损坏时不持锁并返回false
+  bool Lock();
+  void Unlock() { pthread_mutex_unlock(&_mutex); }
+  // 空闲块的插入与移除，[1,PAGE_NUM)页按页数精确分桶，不小于PAGE_NUM页的放在最后一个桶
+  void InsertFree(uint32_t page, uint32_t size);
+  void RemoveFree(uint32_t page);
+  // 设置块的边界标记
+  void SetBlock(uint32_t page, uint32_t size, bool free);
+
+ private:
+  uint64_t _magic;
+  uintptr_t _base;      // 各进程的映射地址
+  size_t _bytes;        // 区域总字节数
+  uint32_t _pageCount;  // 区域总页数
+  uint32_t _firstPage;  // 第一个数据页
+  uint32_t _poisoned;   // 持锁进程异常退出后置1，不再恢复
+  pthread_mutex_t _mutex;  // PTHREAD_PROCESS_SHARED且robust，持锁进程退出后其他进程仍可加锁
+  uint32_t _freeHeads[PAGE_NUM + 1];
+};
+#endif
@@ -1,21 +1,220 @@
 #pragma once
 #include "Common.h"
 
+class AsyncFreeQueue;
+class ThreadCache;
+
+// 分配器经过的各条路径，除线程缓存命中外都是慢路径
+enum AllocPath {
+  PATH_HIT,            // 线程缓存命中
+  PATH_REFILL,         // 线程缓存从CentralCache批量补充
+  PATH_SPAN_SCAN,      // CentralCache查找非空Span时跳过的Span数
+  PATH_ALLOCATE_SPAN,  // CentralCache向PageHeap申请Span
+  PATH_HEAP_SPLIT,     // PageHeap切分更大的空闲Span
+  PATH_MMAP,           // PageHeap向系统映射新内存
+  PATH_COALESCE,       // PageHeap与相邻空闲Span合并
+  PATH_LARGE_ALLOC,    // 大于256KB的申请
+  PATH_NUM
+};
+
+// 各路径计数，按AllocPath下标
+struct PathStats {
+  size_t _counts[PATH_NUM] = {};
+};
+
+// TLS:Thread Local Storage
+// 线程独立缓存，无锁设计，提升性能
+// 定义在ThreadCache.cpp中，各编译单元共享同一个线程缓存指针
+// 其他线程请求清空或取走本线程的缓存时将其置空，快速路径已有的空指针检查即可把本线程引入慢路径
+extern CONCUR_TLS std::atomic<ThreadCache*> pThreadCache;
+// 本线程访问线程缓存的操作计数，其他线程取走缓存时读取
+extern CONCUR_TLS std::atomic<size_t> tcOpSeq;
+
 class ThreadCache {
  public:
-  // 与Thread交互
+  ThreadCache();
+
+  // 与Thread交互，快速路径在头文件中内联
+  // 以下四个函数须在BeginOp之后、且读到pThreadCache指向本缓存时调用，返回前结束该操作
   void* Allocate(size_t bytes);
+  // 已知哈希桶下标时申请，免去计算下标
+  void* AllocateIndex(size_t index);
   void Deallocate(void* ptr, size_t bytes);
-  // 与CentralCache交互
-  void* FetchFromCentralCache(FreeList& list, size_t objSize);
-  void ReleaseToCentralCache(FreeList& list, size_t objSize);
+  // 已知哈希桶下标时释放，免去重新计算下标
+  void DeallocateIndex(void* ptr, size_t index);
+  // 与CentralCache交互，在AllocateIndex开始的操作中调用，向CentralCache取对象期间不在操作中
+  CONCUR_COLD void* FetchFromCentralCache(FreeList& list, size_t objSize);
+  void ReleaseToCentralCache(FreeList& list, size_t objSize, size_t n);
+
+  // 开始与结束一次访问自由链表的操作：开始与结束时本线程的tcOpSeq各加1，奇数表示操作中。
+  // 操作不会嵌套：可能调用外部代码（超过硬上限的处理函数）的路径先结束操作
+  static void BeginOp() {
+    tcOpSeq.store(tcOpSeq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    // 只阻止编译器把之后对pThreadCache与自由链表的访问提到前面，处理器层面的
+    // 重排由取走缓存的线程用ProcessBarrier消除
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  }
+  static void EndOp() {
+    tcOpSeq.store(tcOpSeq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+  // 不经过ConcurAlloc/ConcurFree快速路径的调用由本线程先开始操作，本缓存被请求清空时先完成清空
+  void BeginOwnOp();
+  // pThreadCache被其他线程置空后由本线程调用：等待正在取走本缓存的线程完成，
+  // 按请求清空缓存，再恢复pThreadCache
+  CONCUR_COLD void OnFlushRequested();
+
+  // 预先从CentralCache取count个bytes字节的对象，并把链表上限至少提到一批，跳过慢启动
+  void Prewarm(size_t bytes, size_t count);
+  // 开启后归还CentralCache的批量对象与大块内存交给后台回收线程释放，队列满时仍同步释放
+  void SetAsyncFree(bool enable);
+  // 释放大块内存，开启异步释放时入队
+  CONCUR_COLD void FreeLarge(void* ptr);
+  // 队列满而同步释放的次数
+  size_t AsyncFallbacks() const;
+
+  // 进入与退出读临界区，可嵌套，只有最外层改变本线程登记的纪元
+  void EnterEpoch();
+  void ExitEpoch();
+  // 退休一个对象，链入当前纪元的待回收链表，所有线程都经过该纪元后才放回自由链表
+  void Retire(void* ptr);
+  // 尝试推进全局纪元并释放已安全的待回收对象，返回本线程仍在等待的对象数
+  CONCUR_COLD size_t ReclaimRetired();
+
+  // 将全部缓存对象归还CentralCache，链表回到慢启动状态
+  CONCUR_COLD void Flush();
+  // 当前缓存的bytes字节对象数
+  size_t CachedObjects(size_t bytes);
+  // 请求所有线程在下一次申请或释放时清空各自的缓存，不归还任何对象，持有页堆锁时也可调用
+  static void RequestFlushAll();
+  // 清空所有线程缓存：不在申请释放中的由调用线程直接取走归还，其余的请求其自行清空
+  static void FlushAll();
+  // 设置闲置时长，超过该时长没有任何申请释放的线程缓存由其他线程取走归还，0表示不启用
+  static void SetDecay(size_t ms);
+  // 线程退出时由本线程调用：交出待回收对象与异步释放队列，从线程缓存链表中移除，再归还缓存对象
+  void Exit();
+
+  // 当前线程经过路径path的计数加n，只有本线程写入，不用原子加法
+  void CountPath(AllocPath path, size_t n = 1) {
+    _pathCounts[path].store(_pathCounts[path].load(std::memory_order_relaxed) + n,
+                            std::memory_order_relaxed);
+  }
+  // 供CentralCache与PageHeap调用，没有线程缓存的线程计入全局计数
+  static void CountCurrentPath(AllocPath path, size_t n = 1);
+  // 汇总所有线程（含已退出线程）的路径计数
+  static PathStats CollectPathStats();
+
+ private:
+  // 自由链表超过上限时归还一批对象，频繁超长则缩小上限
+  CONCUR_COLD void ListTooLong(FreeList& list, size_t objSize);
+  // 距上次回收超过SCAVENGE_MS时，按低水位归还各自由链表中上个周期未被使用的对象，并缩小闲置链表的上限，
+  // 再取走闲置过久的其他线程缓存
+  CONCUR_COLD void Scavenge();
+  // 清空全部自由链表，own为false时由取走缓存的线程调用，不经过所属线程的异步释放队列
+  void FlushLists(bool own);
+  // 设置清空请求并置空所属线程的pThreadCache，使其下一次操作进入慢路径
+  void RequestFlush();
+  // 取走其他线程的缓存，idleOnly时只取闲置超过_decayMs的；线程缓存链表锁已被占用且wait为false时放弃
+  static void ReclaimCaches(bool idleOnly, bool wait);
+  // 所有处于临界区的线程都已登记当前纪元时推进一次，成功返回true
+  static bool TryAdvanceEpoch();
+  // 把第i个待回收链表中的对象放回自由链表
+  void ReleaseLimbo(size_t i);
+  // 把一串待回收对象放回本线程的自由链表或释放大块内存
+  void ReleaseRetired(void* ptr);
+  // 线程退出时把待回收链表并入已退出线程的全局待回收链表
+  void OrphanRetired();
 
  private:
   FreeList _freeLists[LIST_NUM];
+  size_t _shard;                // 优先使用的CentralCache哈希桶分片
+  size_t _deallocCount = 0;     // 距上次检查回收时间的释放次数
+  uint32_t _scavengeMs;         // 上次回收的时间(ms)
+  // 所属线程的pThreadCache与tcOpSeq，在所属线程中构造时记录，其他线程取走缓存时经此访问
+  std::atomic<ThreadCache*>* _cacheSlot;
+  std::atomic<size_t>* _opSeq;
+  std::atomic<bool> _flushRequested{false};  // 其他线程请求清空缓存或已取走缓存
+  std::mutex _reclaimMutex;                  // 其他线程取走缓存时持有，本线程只在清空时加锁
+  // 以下三项由取走缓存的线程在线程缓存链表锁下读写，其余两项在_reclaimMutex下读写
+  size_t _idleSeq = 0;                       // 上次检查时的操作计数
+  uint32_t _idleSince = 0;                   // 首次看到_idleSeq的时间(ms)
+  size_t _reclaimedSeq = 1;                  // 最近一次尝试取走时的操作计数，避免重复取走，初值为奇数
+  size_t _reclaimSeq = 0;                    // 本次取走前读到的操作计数
+  ThreadCache* _reclaimNext = nullptr;       // 本次取走的候选组成的单链表
+  ThreadCache* _nextCache = nullptr;         // 所有线程缓存组成的单链表
+  AsyncFreeQueue* _asyncQueue = nullptr;     // 异步释放队列，首次开启时创建
+  bool _asyncFree = false;                   // 是否开启异步释放
+  // 路径计数只由本线程写入，汇总时其他线程读取
+  std::atomic<size_t> _pathCounts[PATH_NUM];
+  // 本线程登记的纪元：处于临界区时为(纪元 << 1) | 1，否则为0，推进纪元时其他线程读取
+  std::atomic<size_t> _epoch{0};
+  size_t _epochDepth = 0;                       // 临界区嵌套深度
+  void* _limbo[EPOCH_LIMBO_NUM] = {};           // 待回收链表，借用对象头部存储下一个对象
+  size_t _limboEpoch[EPOCH_LIMBO_NUM] = {};     // 各待回收链表中对象退休时的纪元
+  size_t _limboSize[EPOCH_LIMBO_NUM] = {};
+  size_t _retireCount = 0;                      // 距上次尝试推进纪元的退休次数
+
+  static ThreadCache* _caches;
+  static std::mutex _cachesMutex;
+  static std::atomic<size_t> _decayMs;
+  static std::atomic<size_t> _orphanPathCounts[PATH_NUM];
+  // 已退出线程留下的待回收链表，下标与纪元的对应关系同_limbo，由线程缓存链表锁保护
+  static void* _orphanLimbo[EPOCH_LIMBO_NUM];
+  static size_t _orphanLimboEpoch[EPOCH_LIMBO_NUM];
+  alignas(CACHE_LINE_SIZE) static std::atomic<size_t> _globalEpoch;
 };
 
-// TLS:Thread Local Storage
-// 线程独立缓存，无锁设计，提升性能
-static thread_local ThreadCache* pThreadCache = nullptr;
+inline void* ThreadCache::Allocate(size_t bytes) {
+  assert(bytes <= MAX_BYTES);
+  return AllocateIndex(SizeMap::Index(bytes));
+}
+
+inline void* ThreadCache::AllocateIndex(size_t index) {
+  assert(index < CLASS_NUM);
+  FreeList& list = _freeLists[index];
+
+  if (CONCUR_LIKELY(!list.Empty())) {
+    // 先取出再计数，计数的原子写入不会迫使编译器重新读取链表头
+    void* obj = list.Pop();
+    CountPath(PATH_HIT);
+    EndOp();
+    return obj;
+  } else {
+    return FetchFromCentralCache(list, SizeMap::ClassSize(index));
+  }
+}
+
+inline void ThreadCache::Deallocate(void* ptr, size_t bytes) {
+  assert(bytes <= MAX_BYTES);
+  DeallocateIndex(ptr, SizeMap::Index(bytes));
+}
+
+inline void ThreadCache::DeallocateIndex(void* ptr, size_t index) {
+  assert(ptr);
+  assert(index < CLASS_NUM);
+  FreeList& list = _freeLists[index];
+  list.Push(ptr);
+
+  if (CONCUR_UNLIKELY(list.Size() > list.MaxSize())) {
+    ListTooLong(list, SizeMap::ClassSize(index));
+  }
+  if (CONCUR_UNLIKELY(++_deallocCount >= SCAVENGE_INTERVAL)) {
+    Scavenge();
+  }
+  EndOp();
+}
+
+// 登记当前全局纪元后加全屏障，保证推进纪元的线程看到登记，或本线程看到对象已被摘下
+inline void ThreadCache::EnterEpoch() {
+  if (_epochDepth++ == 0) {
+    _epoch.store((_globalEpoch.load(std::memory_order_relaxed) << 1) | 1,
+                 std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
 
-static ObjectPool<ThreadCache> tcPool;
\ No newline at end of file
+inline void ThreadCache::ExitEpoch() {
+  assert(_epochDepth > 0);
+  if (--_epochDepth == 0) {
+    _epoch.store(0, std::memory_order_release);
+  }
+}
@@ -0,0 +1,116 @@
+#include "AsyncFree.h"
+
+#include "CentralCache.h"
+#include "PageHeap.h"
+
+static ObjectPool<AsyncFreeQueue> queuePool;
+
+bool AsyncFreeQueue::Push(void* start, void* end, size_t objSize) {
+  size_t tail = _tail.load(std::memory_order_relaxed);
+  if (tail - _head.load(std::memory_order_acquire) == ASYNC_FREE_QUEUE) {
+    return false;
+  }
+  _entries[tail % ASYNC_FREE_QUEUE] = {start, end, objSize};
+  _tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+bool AsyncFreeQueue::Pop(Entry& entry) {
+  size_t head = _head.load(std::memory_order_relaxed);
+  if (head == _tail.load(std::memory_order_acquire)) {
+    return false;
+  }
+  entry = _entries[head % ASYNC_FREE_QUEUE];
+  _head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+// 先构造CentralCache与PageHeap，使其晚于回收线程析构，退出时回收线程仍能清空队列
+AsyncReclaimer::AsyncReclaimer() {
+  CentralCache::Instance();
+  PageHeap::Instance();
+}
+
+AsyncReclaimer::~AsyncReclaimer() {
+  if (_thread.joinable()) {
+    _mutex.lock();
+    _stop = true;
+    _mutex.unlock();
+    _cond.notify_one();
+    _thread.join();
+  }
+}
+
+// 复用的队列在锁下交接，新线程能看到原所属线程最后写入的_tail
+AsyncFreeQueue* AsyncReclaimer::Register() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (AsyncFreeQueue* queue = _queues.load(std::memory_order_relaxed); queue != nullptr;
+         queue = queue->_next) {
+      if (queue->_abandoned) {
+        queue->_abandoned = false;
+        queue->_fallbacks.store(0, std::memory_order_relaxed);
+        return queue;
+      }
+    }
+  }
+  AsyncFreeQueue* queue = queuePool.New();
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  queue->_next = _queues.load(std::memory_order_relaxed);
+  _queues.store(queue, std::memory_order_release);
+  if (!_thread.joinable()) {
+    _thread = std::thread(&AsyncReclaimer::Run, this);
+  }
+  return queue;
+}
+
+void AsyncReclaimer::Unregister(AsyncFreeQueue* queue) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  queue->_abandoned = true;
+}
+
+void AsyncReclaimer::Release(const AsyncFreeQueue::Entry& entry) {
+  if (entry._objSize != 0) {
+    CentralCache::Instance().InsertRange(entry._start, entry._end, entry._objSize);
+  } else {
+    Span* span = PageHeap::Instance().ObjectToSpan(entry._start);
+    PageHeap::Instance().Mutex().lock();
+    PageHeap::Instance().Delete(span);
+    PageHeap::Instance().Mutex().unlock();
+  }
+}
+
+size_t AsyncReclaimer::Drain() {
+  std::lock_guard<std::mutex> lock(_drainMutex);
+  size_t count = 0;
+  AsyncFreeQueue::Entry entry;
+  for (AsyncFreeQueue* queue = _queues.load(std::memory_order_acquire); queue != nullptr;
+       queue = queue->_next) {
+    while (queue->Pop(entry)) {
+      Release(entry);
+      ++count;
+    }
+  }
+  _reclaimed.fetch_add(count, std::memory_order_relaxed);
+  return count;
+}
+
+// 有待释放的项时立即再次轮询，否则轮询间隔从1ms起倍增到ASYNC_FREE_MAX_POLL_MS
+void AsyncReclaimer::Run() {
+  size_t pollMs = 1;
+  while (true) {
+    if (Drain() > 0) {
+      pollMs = 1;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_stop) {
+      break;
+    }
+    _cond.wait_for(lock, std::chrono::milliseconds(pollMs));
+    pollMs = std::min(pollMs * 2, ASYNC_FREE_MAX_POLL_MS);
+  }
+  Drain();
+}
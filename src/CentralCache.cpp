@@ -1,6 +1,20 @@
 #include "CentralCache.h"
 
 #include "PageHeap.h"
+#include "ThreadCache.h"
+
+static ObjectPool<SpanBitmap> bitmapPool;
+
+// 对象偏移不超过一个Span（最多32页即2^18字节），乘以2^42/objSize向上取整后右移42位即为精确的商
+static const size_t DIV_SHIFT = 42;
+
+CentralCache::CentralCache() {
+  for (size_t i = 0; i < CLASS_NUM; ++i) {
+    size_t objSize = SizeMap::ClassSize(i);
+    _spanObjects[i] = (uint16_t)((SizeMap::PageMoveNum(objSize) << PAGE_SHIFT) / objSize);
+    _divMagic[i] = ((uint64_t)1 << DIV_SHIFT) / objSize + 1;
+  }
+}
 
 // 从ThreadCache插入批量对应大小的对象
 void CentralCache::InsertRange(void* start, void* end, size_t objSize) {
@@ -8,41 +22,81 @@ void CentralCache::InsertRange(void* start, void* end, size_t objSize) {
   assert(objSize <= MAX_BYTES);
 
   size_t index = SizeMap::Index(objSize);
-  SpanList& list = _spanLists[index];
-  list.Mutex().lock();
+  SpanList* lists = _spanLists[index];
+  SpanList* locked = nullptr;
 
   void* cur = start;
   while (cur != nullptr) {
-    void* next = FreeList::Next(cur);
-    ReleaseToSpans(list, cur);  // 此处内部会改变cur的指向，所以要提前存储
+    void* next = FreeList::Next(cur);  // ReleaseToSpans内部会改变cur的指向，所以要提前存储
+    Span* span = PageHeap::Instance().ObjectToSpan(cur);
+    // 对象归还到其Span所属的分片，分片变化时换锁
+    SpanList& list = lists[span->_shard];
+    if (&list != locked) {
+      if (locked != nullptr) {
+        locked->Mutex().unlock();
+      }
+      Lock(list);
+      locked = &list;
+    }
+    ReleaseToSpans(list, cur, span);
     cur = next;
   }
 
-  list.Mutex().unlock();
+  locked->Mutex().unlock();
 }
 
 // 移除批量对应大小的对象到ThreadCache
-size_t CentralCache::RemoveRange(void*& start, void*& end, size_t batchNum, size_t objSize) {
+size_t CentralCache::RemoveRange(void*& start, void*& end, size_t batchNum, size_t objSize,
+                                 size_t shard) {
   assert(objSize <= MAX_BYTES);
 
   size_t index = SizeMap::Index(objSize);
-  SpanList& list = _spanLists[index];
-  list.Mutex().lock();
+  size_t shards = ShardNum(objSize);
+  shard %= shards;
+  SpanList* list = &_spanLists[index][shard];
+  Lock(*list);
 
-  Span* span = FetchSpan(list, objSize);
-  assert(span && span->_freeList);
+  // 本分片没有空闲对象时先向兄弟分片借用，都没有再由本分片向PageHeap申请
+  size_t scanned = 0;
+  Span* span = FindSpan(*list, index, scanned);
+  for (size_t i = 1; span == nullptr && i < shards; ++i) {
+    list->Mutex().unlock();
+    list = &_spanLists[index][(shard + i) % shards];
+    Lock(*list);
+    span = FindSpan(*list, index, scanned);
+  }
+  if (span == nullptr) {
+    if (shards > 1) {
+      list->Mutex().unlock();
+      list = &_spanLists[index][shard];
+      Lock(*list);
+    }
+    span = FetchSpan(*list, objSize, scanned);
+  }
+  assert(span && HasFree(span, index));
+  if (scanned > 0) {
+    ThreadCache::CountCurrentPath(PATH_SPAN_SCAN, scanned);
+    CONCUR_PROBE(span_scan, index, scanned);
+  }
 
   size_t actualNum = 1;
-  start = end = span->_freeList;
-  for (size_t i = 0; i < batchNum - 1 && FreeList::Next(end) != nullptr; ++i) {
-    end = FreeList::Next(end);
-    ++actualNum;
+  if (span->_bitmapped) {
+    actualNum = TakeFromBitmap(span, index, batchNum, start, end);
+  } else {
+    start = end = span->_freeList;
+    for (size_t i = 0; i < batchNum - 1 && FreeList::Next(end) != nullptr; ++i) {
+      end = FreeList::Next(end);
+      ++actualNum;
+    }
+    span->_freeList = FreeList::Next(end);
+    FreeList::Next(end) = nullptr;
   }
-  span->_freeList = FreeList::Next(end);
-  FreeList::Next(end) = nullptr;
 
+  if (span->_useCount == 0) {
+    --list->_emptyNum;
+  }
   span->_useCount += actualNum;
-  list.Mutex().unlock();
+  list->Mutex().unlock();
   return actualNum;
 }
 
@@ -52,32 +106,74 @@ Span* CentralCache::AllocateSpan(SpanList& list, size_t objSize) {
   // 解除桶锁，让ThreadCache能够释放对象给CentralCache
   list.Mutex().unlock();
 
-  PageHeap::Instance().Mutex().lock();
-  Span* span = PageHeap::Instance().New(SizeMap::PageMoveNum(objSize));
-  PageHeap::Instance().Mutex().unlock();
+  // 页堆超过软上限时请求归还保留的空闲Span，此时未持有任何锁
+  if (_releaseRequested.load(std::memory_order_relaxed) &&
+      _releaseRequested.exchange(false, std::memory_order_relaxed)) {
+    ReleaseEmptySpans();
+  }
+
+  size_t pages = SizeMap::PageMoveNum(objSize);
+  ThreadCache::CountCurrentPath(PATH_ALLOCATE_SPAN);
+  CONCUR_PROBE(allocate_span, SizeMap::Index(objSize), pages);
+  Span* span = nullptr;
+  while (true) {
+    _heapLocks.fetch_add(1, std::memory_order_relaxed);
+    PageHeap::Instance().Mutex().lock();
+    span = PageHeap::Instance().New(pages);
+    if (span != nullptr) {
+      // 页映射写入时可能申请结点，需在页堆锁内完成
+      PageHeap::Instance().SetSizeClass(span, SizeMap::Index(objSize));
+    }
+    PageHeap::Instance().Mutex().unlock();
+    if (span != nullptr) {
+      break;
+    }
+    // 超过硬上限，此时未持有任何锁，可以调用处理函数或抛出std::bad_alloc
+    PageHeap::Instance().HandleLimit(pages << PAGE_SHIFT);
+  }
+
+  size_t index = SizeMap::Index(objSize);
+  span->_shard = (uint8_t)(&list - _spanLists[index]);
+
+  // 位图Span无需切割，也就不会写入（或触发缺页）尚未使用的对象
+  size_t objNum = _spanObjects[index];
+  if (objNum <= SPAN_BITMAP_BITS && _bitmapSpans.load(std::memory_order_relaxed)) {
+    SpanBitmap* bitmap = bitmapPool.New();
+    for (uint64_t& word : bitmap->_words) {
+      size_t bits = std::min(objNum, (size_t)64);
+      word = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+      objNum -= bits;
+    }
+    span->_bitmap = bitmap;
+    span->_bitmapped = true;
 
-  span->_objSize = objSize;
+    Lock(list);
+    list.PushFront(span);
+    ++list._emptyNum;
+    return span;
+  }
 
   // 计算Span管理的大块内存的首尾地址
   char* start = (char*)(span->_start << PAGE_SHIFT);
-  char* end = start + (span->_size << PAGE_SHIFT);
+  char* end = start + ((size_t)span->_size << PAGE_SHIFT);
 
   // 将Span管理的大块内存切割为对象，悬挂于_freeList
   span->_freeList = start;
   char* prev = start;
   char* cur = start + objSize;
-  while (cur < end) {
+  // 末尾不足objSize的剩余内存不切割，否则该对象会越过Span末尾
+  while (cur + objSize <= end) {
     FreeList::Next(prev) = cur;
     prev = cur;
     cur += objSize;
   }
-  // 最后一块对象如果小于objSize怎么办，到时候分配的时候大小不够？
   FreeList::Next(prev) = nullptr;
 
   // 切分Span时无需加锁，要挂入SpanList前再加桶锁
-  list.Mutex().lock();
+  Lock(list);
   // 将新的Span挂入对应的SpanList
   list.PushFront(span);
+  ++list._emptyNum;
   return span;
 }
 
@@ -88,42 +184,200 @@ void CentralCache::DeallocateSpans(SpanList& list, Span* span) {
   list.Remove(span);
   span->_prev = nullptr;
   span->_next = nullptr;
-  span->_freeList = nullptr;
+  ResetSpan(span);
 
   list.Mutex().unlock();
 
+  _heapLocks.fetch_add(1, std::memory_order_relaxed);
   PageHeap::Instance().Mutex().lock();
   PageHeap::Instance().Delete(span);
   PageHeap::Instance().Mutex().unlock();
 
-  list.Mutex().lock();
+  Lock(list);
 }
 
-// 获取第一个非空的Span
-Span* CentralCache::FetchSpan(SpanList& list, size_t objSize) {
+// 获取第一个非空的Span，没有则向PageHeap申请
+Span* CentralCache::FetchSpan(SpanList& list, size_t objSize, size_t& scanned) {
   assert(objSize <= MAX_BYTES);
 
+  Span* span = FindSpan(list, SizeMap::Index(objSize), scanned);
+  if (span != nullptr) {
+    return span;
+  }
+
+  return AllocateSpan(list, objSize);
+}
+
+// 查找第一个非空的Span，没有返回nullptr，scanned累加跳过的Span数
+Span* CentralCache::FindSpan(SpanList& list, size_t index, size_t& scanned) {
   auto cur = list.Begin();
   while (cur != list.End()) {
-    if (cur->_freeList != nullptr) {
+    if (HasFree(cur, index)) {
       return cur;
     }
+    ++scanned;
     cur = cur->_next;
   }
+  return nullptr;
+}
 
-  return AllocateSpan(list, objSize);
+size_t CentralCache::TakeFromBitmap(Span* span, size_t index, size_t batchNum, void*& start,
+                                    void*& end) {
+  char* base = (char*)(span->_start << PAGE_SHIFT);
+  size_t objSize = SizeMap::ClassSize(index);
+  uint64_t* words = span->_bitmap->_words;
+  size_t actualNum = 0;
+  void* prev = nullptr;
+  for (size_t w = 0; w < SPAN_BITMAP_BITS / 64 && actualNum < batchNum; ++w) {
+    uint64_t bits = words[w];
+    while (bits != 0 && actualNum < batchNum) {
+      void* obj = base + ((w << 6) + CountTrailingZeros(bits)) * objSize;
+      bits &= bits - 1;
+      if (prev == nullptr) {
+        start = obj;
+      } else {
+        FreeList::Next(prev) = obj;
+      }
+      prev = obj;
+      ++actualNum;
+    }
+    words[w] = bits;
+  }
+  assert(prev);
+  FreeList::Next(prev) = nullptr;
+  end = prev;
+  return actualNum;
+}
+
+void CentralCache::ResetSpan(Span* span) {
+  if (span->_bitmapped) {
+    bitmapPool.Delete(span->_bitmap);
+    span->_bitmapped = false;
+  }
+  span->_freeList = nullptr;
+}
+
+// 加桶锁，启用锁竞争统计时统计拿不到锁的等待时间
+void CentralCache::Lock(SpanList& list) {
+#ifdef CONCUR_LOCK_PROFILE
+  if (list.Mutex().try_lock()) {
+    return;
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  list.Mutex().lock();
+  auto end = std::chrono::steady_clock::now();
+  _lockWaits.fetch_add(1, std::memory_order_relaxed);
+  _lockWaitNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count(),
+                        std::memory_order_relaxed);
+#else
+  list.Mutex().lock();
+#endif
 }
 
 // 释放一个对象到对应的Span
-void CentralCache::ReleaseToSpans(SpanList& list, void* obj) {
-  assert(obj);
+void CentralCache::ReleaseToSpans(SpanList& list, void* obj, Span* span) {
+  assert(obj && span);
 
-  Span* span = PageHeap::Instance().ObjectToSpan(obj);
-  FreeList::Next(obj) = span->_freeList;
-  span->_freeList = obj;
+  if (span->_bitmapped) {
+    // 由对象偏移算出下标后置位，不写入对象本身
+    size_t offset = (char*)obj - (char*)(span->_start << PAGE_SHIFT);
+    size_t i = (offset * _divMagic[span->_sizeClass - 1]) >> DIV_SHIFT;
+    uint64_t bit = (uint64_t)1 << (i & 63);
+    assert(!(span->_bitmap->_words[i >> 6] & bit));
+    span->_bitmap->_words[i >> 6] |= bit;
+  } else {
+    FreeList::Next(obj) = span->_freeList;
+    span->_freeList = obj;
+  }
   --span->_useCount;
 
   if (span->_useCount == 0) {
-    DeallocateSpans(list, span);
+    // 保留少量空闲Span，避免在Span边界来回申请释放时反复向PageHeap切分与归还
+    if (list._emptyNum < _emptyLimit.load(std::memory_order_relaxed)) {
+      ++list._emptyNum;
+      // 移到链表尾部，FindSpan优先使用部分占用的Span，保留的Span得以保持空闲
+      list.Remove(span);
+      list.Insert(list.End(), span);
+    } else {
+      DeallocateSpans(list, span);
+    }
+  }
+}
+
+// 将保留的空闲Span全部归还PageHeap，返回归还的个数
+size_t CentralCache::ReleaseEmptySpans() {
+  // 先在各桶锁内摘下空闲Span，经_next串成单链表，最后一次性在页堆锁内归还
+  Span* released = nullptr;
+  size_t count = 0;
+  for (size_t i = 0; i < CLASS_NUM; ++i) {
+    for (size_t j = 0; j < ShardNum(SizeMap::ClassSize(i)); ++j) {
+      SpanList& list = _spanLists[i][j];
+      Lock(list);
+      Span* cur = list.Begin();
+      while (list._emptyNum > 0 && cur != list.End()) {
+        Span* next = cur->_next;
+        if (cur->_useCount == 0) {
+          list.Remove(cur);
+          cur->_prev = nullptr;
+          ResetSpan(cur);
+          cur->_next = released;
+          released = cur;
+          --list._emptyNum;
+          ++count;
+        }
+        cur = next;
+      }
+      list.Mutex().unlock();
+    }
+  }
+
+  if (released != nullptr) {
+    _heapLocks.fetch_add(1, std::memory_order_relaxed);
+    PageHeap::Instance().Mutex().lock();
+    while (released != nullptr) {
+      Span* next = released->_next;
+      released->_next = nullptr;
+      PageHeap::Instance().Delete(released);
+      released = next;
+    }
+    PageHeap::Instance().Mutex().unlock();
+  }
+  return count;
+}
+#ifdef CONCUR_LOCK_PROFILE
+// 按哈希桶汇总各分片桶锁的竞争统计，打印等待时间最长（其次加锁最多）的topN个桶及其等待者调用栈
+void CentralCache::DumpLockProfile(size_t topN) {
+  std::vector<std::pair<ProfiledMutex::Stats, size_t>> classes;
+  for (size_t i = 0; i < CLASS_NUM; ++i) {
+    ProfiledMutex::Stats stats;
+    for (size_t j = 0; j < ShardNum(SizeMap::ClassSize(i)); ++j) {
+      stats.Add(_spanLists[i][j].Mutex().Snapshot());
+    }
+    if (stats._acquires != 0) {
+      classes.emplace_back(stats, i);
+    }
   }
-}
\ No newline at end of file
+  std::sort(classes.begin(), classes.end(), [](const auto& left, const auto& right) {
+    if (left.first._waitNs != right.first._waitNs) {
+      return left.first._waitNs > right.first._waitNs;
+    }
+    return left.first._acquires > right.first._acquires;
+  });
+
+  for (size_t k = 0; k < std::min(topN, classes.size()); ++k) {
+    size_t index = classes[k].second;
+    char name[32];
+    snprintf(name, sizeof(name), "%zuB(%zu分片)", SizeMap::ClassSize(index),
+             ShardNum(SizeMap::ClassSize(index)));
+
+    // 打印第一个有采样的分片的等待者调用栈
+    ProfiledMutex::Sample samples[ProfiledMutex::SAMPLE_NUM];
+    size_t sampleNum = 0;
+    for (size_t j = 0; j < ShardNum(SizeMap::ClassSize(index)) && sampleNum == 0; ++j) {
+      _spanLists[index][j].Mutex().Snapshot(samples, &sampleNum);
+    }
+    ProfiledMutex::Print(name, classes[k].first, samples, sampleNum);
+  }
+}
+#endif
@@ -1,13 +1,41 @@
 #include "Common.h"
 
+#if defined(CONCUR_LOCK_PROFILE) && defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23
+#endif
+
 // 向堆申请空间
 void* SystemAllocator::Alloc(size_t bytes) {
 #ifdef _WIN32
   void* ptr = VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 #else  // linux/macOS下用mmap分配内存
-  void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  // mmap只保证按系统页(4KB)对齐，多申请一页后裁剪首尾，保证按PAGE_SHIFT对齐
+  const size_t alignBytes = (size_t)1 << PAGE_SHIFT;
+  void* ptr = mmap(nullptr, bytes + alignBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
   if (ptr == MAP_FAILED) {
     ptr = nullptr;
+  } else {
+    uintptr_t addr = (uintptr_t)ptr;
+    uintptr_t alignAddr = (addr + alignBytes - 1) & ~(alignBytes - 1);
+    size_t head = alignAddr - addr;
+    if (head > 0) {
+      munmap(ptr, head);
+    }
+    if (alignBytes - head > 0) {
+      munmap((char*)alignAddr + bytes, alignBytes - head);
+    }
+    ptr = (void*)alignAddr;
   }
 #endif
   if (ptr == nullptr) {
@@ -25,22 +53,118 @@ void SystemAllocator::Free(void* ptr, size_t bytes) {
 #endif
 }
 
-// 在每个内存块（对象）头部存储指针，指针大小兼容32位和64位平台
-void*& FreeList::Next(void* obj) { return *(void**)obj; }
+// 调整已申请空间的大小，可能搬移地址但不拷贝数据，失败返回nullptr
+void* SystemAllocator::Realloc(void* ptr, size_t oldBytes, size_t newBytes) {
+#ifdef __linux__  // linux下用mremap重新映射页表，避免拷贝
+  // 优先原地扩展
+  void* newPtr = mremap(ptr, oldBytes, newBytes, 0);
+  if (newPtr != MAP_FAILED) {
+    return newPtr;
+  }
+  // 否则先占好一段对齐的地址，再把原页表整体搬过去
+  void* dest = Alloc(newBytes);
+  newPtr = mremap(ptr, oldBytes, newBytes, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+  if (newPtr == MAP_FAILED) {
+    Free(dest, newBytes);
+    return nullptr;
+  }
+  return newPtr;
+#else
+  return nullptr;
+#endif
+}
+
+// 将空间归还操作系统但保留映射，再次访问时为全零页
+void SystemAllocator::Release(void* ptr, size_t bytes) {
+#ifdef _WIN32
+  VirtualFree(ptr, bytes, MEM_DECOMMIT);
+  VirtualAlloc(ptr, bytes, MEM_COMMIT, PAGE_READWRITE);
+#else  // linux/macOS下用madvise释放物理页
+  madvise(ptr, bytes, MADV_DONTNEED);
+#endif
+}
+
+// 预先触发空间的缺页，lock时锁定在物理内存中，失败返回false
+bool SystemAllocator::Populate(void* ptr, size_t bytes, bool lock) {
+#ifdef _WIN32
+  if (lock) {
+    return VirtualLock(ptr, bytes);
+  }
+#else
+  if (lock) {
+    // mlock会同时触发缺页
+    return mlock(ptr, bytes) == 0;
+  }
+#ifdef __linux__
+  // Linux 5.14起可一次系统调用预填充页表，旧内核返回EINVAL时退回逐页写入
+  if (madvise(ptr, bytes, MADV_POPULATE_WRITE) == 0) {
+    return true;
+  }
+#endif
+#endif
+  // 每个系统页写一次，新映射的页全为零，写入零不改变内容
+  const size_t osPage = 4096;
+  for (size_t i = 0; i < bytes; i += osPage) {
+    ((volatile char*)ptr)[i] = 0;
+  }
+  return true;
+}
 
-void FreeList::Push(void* obj) {
-  assert(obj);
-  Next(obj) = _freeList;
-  _freeList = obj;
-  ++_size;
+// 只预留按PAGE_SHIFT对齐的虚拟地址，不可访问也不占用物理内存
+void* SystemAllocator::Reserve(size_t bytes) {
+#ifdef _WIN32
+  void* ptr = VirtualAlloc(0, bytes, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  // 与Alloc相同，多预留一页后裁剪首尾以按PAGE_SHIFT对齐；MAP_NORESERVE不计入overcommit
+  const size_t alignBytes = (size_t)1 << PAGE_SHIFT;
+  void* ptr = mmap(nullptr, bytes + alignBytes, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    ptr = nullptr;
+  } else {
+    uintptr_t addr = (uintptr_t)ptr;
+    uintptr_t alignAddr = (addr + alignBytes - 1) & ~(alignBytes - 1);
+    size_t head = alignAddr - addr;
+    if (head > 0) {
+      munmap(ptr, head);
+    }
+    if (alignBytes - head > 0) {
+      munmap((char*)alignAddr + bytes, alignBytes - head);
+    }
+    ptr = (void*)alignAddr;
+  }
+#endif
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
 }
 
-void* FreeList::Pop() {
-  assert(_freeList);
-  void* obj = _freeList;
-  _freeList = Next(obj);
-  --_size;
-  return obj;
+// 提交预留地址中的一段，使其可读写，物理页仍在首次访问时分配
+bool SystemAllocator::Commit(void* ptr, size_t bytes) {
+#ifdef _WIN32
+  return VirtualAlloc(ptr, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  return mprotect(ptr, bytes, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// 使本进程的所有线程各执行一次全屏障，不支持时返回false
+bool ProcessBarrier() {
+#ifdef _WIN32
+  FlushProcessWriteBuffers();
+  return true;
+#elif defined(__linux__) && defined(SYS_membarrier)
+  // 首次调用时注册，之后只向本进程正在运行的线程发送处理器间中断；注册失败时退回全局屏障
+  static const bool expedited =
+      syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+  if (expedited) {
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0;
+  }
+  return syscall(SYS_membarrier, MEMBARRIER_CMD_SHARED, 0, 0) == 0;
+#else
+  return false;
+#endif
 }
 
 void FreeList::PushRange(void* start, void* end, size_t n) {
@@ -61,50 +185,10 @@ size_t FreeList::PopRange(void*& start, void*& end, size_t n) {
   _freeList = Next(end);
   Next(end) = nullptr;
   _size -= actualNum;
-  return actualNum;
-}
-
-bool FreeList::Empty() { return _freeList == nullptr; }
-
-size_t& FreeList::Size() { return _size; }
-
-size_t& FreeList::MaxSize() { return _maxSize; }
-
-// 输入申请字节数，返回对齐字节数
-size_t SizeMap::RoundUp(size_t bytes) {
-  if (bytes <= 128) {
-    return _RoundUp(bytes, 8);
-  } else if (bytes <= 1024) {
-    return _RoundUp(bytes, 16);
-  } else if (bytes <= (8 << 10)) {
-    return _RoundUp(bytes, 128);
-  } else if (bytes <= (64 << 10)) {
-    return _RoundUp(bytes, 1024);
-  } else if (bytes <= (256 << 10)) {
-    return _RoundUp(bytes, 8 << 10);
-  } else {
-    return _RoundUp(bytes, 1 << PAGE_SHIFT);
-  }
-}
-
-// 输入申请字节数，返回对应哈希桶的下标索引
-size_t SizeMap::Index(size_t bytes) {
-  // 每个区间的桶数
-  int groups[] = {16, 56, 56, 56};
-  // 传参时要减去前一个区间的最大字节数
-  if (bytes <= 128) {
-    return _Index(bytes, 3);
-  } else if (bytes <= 1024) {
-    return _Index(bytes - 128, 4) + groups[0];
-  } else if (bytes <= (8 << 10)) {
-    return _Index(bytes - 1024, 7) + groups[0] + groups[1];
-  } else if (bytes <= (64 << 10)) {
-    return _Index(bytes - (8 << 10), 10) + groups[0] + groups[1] + groups[2];
-  } else if (bytes <= (256 << 10)) {
-    return _Index(bytes - (64 << 10), 13) + groups[0] + groups[1] + groups[2] + groups[3];
-  } else {
-    assert(false);
+  if (_size < _lowWater) {
+    _lowWater = _size;
   }
+  return actualNum;
 }
 
 // 输入对象大小，输出（从CentralCache到ThreadCache）对象移动数量
@@ -139,11 +223,6 @@ size_t SizeMap::PageMoveNum(size_t objSize) {
 //   }
 // }
 
-// 位运算写法，较精妙（代入数字便于理解）
-size_t SizeMap::_RoundUp(size_t bytes, size_t alignNum) {
-  return (bytes + alignNum - 1) & ~(alignNum - 1);
-}
-
 // size_t SizeMap::_Index(size_t bytes, size_t alignNum) {
 //   if (bytes % 8 == 0) {
 //     return bytes / alignNum - 1;
@@ -152,11 +231,6 @@ size_t SizeMap::_RoundUp(size_t bytes, size_t alignNum) {
 //   }
 // }
 
-// 计算当前区间的第几个桶
-size_t SizeMap::_Index(size_t bytes, size_t alignShift) {
-  return ((bytes + (1 << alignShift) - 1) >> alignShift) - 1;
-}
-
 SpanList::SpanList() : _head(spanPool.New()) {
   _head->_prev = _head;
   _head->_next = _head;
@@ -192,4 +266,84 @@ Span* SpanList::Remove(Span* pos) {
 
 bool SpanList::Empty() { return _head == _head->_next; }
 
-std::mutex& SpanList::Mutex() { return _mutex; }
\ No newline at end of file
+ConcurMutex& SpanList::Mutex() { return _mutex; }
+#ifdef CONCUR_LOCK_PROFILE
+static size_t ElapsedNs(std::chrono::steady_clock::time_point begin,
+                        std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+}
+
+void ProfiledMutex::Stats::Add(const Stats& other) {
+  _acquires += other._acquires;
+  _contended += other._contended;
+  _waitNs += other._waitNs;
+  _maxWaitNs = std::max(_maxWaitNs, other._maxWaitNs);
+  _holdNs += other._holdNs;
+}
+
+void ProfiledMutex::lock() {
+  if (try_lock()) {
+    return;
+  }
+
+  // 按线程计数采样，在阻塞前记录等待者的调用栈
+  static thread_local size_t waits = 0;
+  Sample sample;
+#ifdef __GLIBC__
+  if (waits++ % SAMPLE_RATE == 0) {
+    sample._depth = backtrace(sample._frames, SAMPLE_DEPTH);
+  }
+#endif
+
+  auto begin = std::chrono::steady_clock::now();
+  _mutex.lock();
+  _lockTime = std::chrono::steady_clock::now();
+
+  size_t waitNs = ElapsedNs(begin, _lockTime);
+  ++_stats._acquires;
+  ++_stats._contended;
+  _stats._waitNs += waitNs;
+  _stats._maxWaitNs = std::max(_stats._maxWaitNs, waitNs);
+  if (sample._depth > 0) {
+    _samples[_sampleCount++ % SAMPLE_NUM] = sample;
+  }
+}
+
+bool ProfiledMutex::try_lock() {
+  if (!_mutex.try_lock()) {
+    return false;
+  }
+  _lockTime = std::chrono::steady_clock::now();
+  ++_stats._acquires;
+  return true;
+}
+
+void ProfiledMutex::unlock() {
+  _stats._holdNs += ElapsedNs(_lockTime, std::chrono::steady_clock::now());
+  _mutex.unlock();
+}
+
+ProfiledMutex::Stats ProfiledMutex::Snapshot(Sample* samples, size_t* sampleNum) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (samples != nullptr) {
+    size_t n = std::min(_sampleCount, SAMPLE_NUM);
+    std::copy(_samples, _samples + n, samples);
+    *sampleNum = n;
+  }
+  return _stats;
+}
+
+void ProfiledMutex::Print(const char* name, const Stats& stats, const Sample* samples,
+                          size_t sampleNum) {
+  printf("%-16s 加锁%10zu次 等待%8zu次 累计等待%10.3f ms 最长等待%8.3f ms 累计持锁%10.3f ms\n",
+         name, stats._acquires, stats._contended, stats._waitNs / 1e6, stats._maxWaitNs / 1e6,
+         stats._holdNs / 1e6);
+  for (size_t i = 0; i < sampleNum; ++i) {
+    printf("  等待者调用栈采样%zu:\n", i + 1);
+#ifdef __GLIBC__
+    fflush(stdout);
+    backtrace_symbols_fd(samples[i]._frames, samples[i]._depth, 1);
+#endif
+  }
+}
+#endif
@@ -1,46 +1,291 @@
 #include "ConcurAlloc.h"
 
-// 对外申请内存接口（代替malloc）
-void* ConcurAlloc(size_t bytes) {
+#include "CentralCache.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+static ObjectPool<ThreadCache> tcPool;
+// 本线程的线程缓存，pThreadCache被其他线程置空时仍指向它
+static CONCUR_TLS ThreadCache* pOwnCache = nullptr;
+
+// 线程退出时归还线程缓存的对象并回收线程缓存本身；之后该线程再申请释放时会重新创建，
+// TLS析构函数随之再被调用一次
+#ifdef _WIN32
+static void WINAPI ThreadCacheExit(void* cache) {
+#else
+static void ThreadCacheExit(void* cache) {
+#endif
+  ((ThreadCache*)cache)->Exit();
+  pThreadCache.store(nullptr, std::memory_order_relaxed);
+  pOwnCache = nullptr;
+  tcPool.Delete((ThreadCache*)cache);
+}
+
+// 把线程缓存登记到带析构函数的TLS键上，主线程退出时不调用
+static void RegisterThreadExit(ThreadCache* cache) {
+#ifdef _WIN32
+  static DWORD key = FlsAlloc(ThreadCacheExit);
+  FlsSetValue(key, cache);
+#else
+  static pthread_key_t key = []() {
+    pthread_key_t k;
+    pthread_key_create(&k, ThreadCacheExit);
+    return k;
+  }();
+  pthread_setspecific(key, cache);
+#endif
+}
+
+// 当前线程的线程缓存，首次调用时创建；被其他线程请求清空或取走时先完成清空
+static ThreadCache* GetThreadCache() {
+  if (pThreadCache.load(std::memory_order_relaxed) == nullptr) {
+    if (pOwnCache == nullptr) {
+      pOwnCache = tcPool.New();
+      RegisterThreadExit(pOwnCache);
+    }
+    pOwnCache->OnFlushRequested();
+  }
+  return pOwnCache;
+}
+
+// 申请慢路径：首次申请时创建线程缓存，大于256KB直接向PageHeap申请
+void* ConcurAllocSlow(size_t bytes) {
   // 小于256KB内存，缓存架构申请
   if (bytes <= MAX_BYTES) {
-    if (pThreadCache == nullptr) {
-      pThreadCache = tcPool.New();
-    }
     // cout << std::this_thread::get_id() << ":" << pThreadCache << endl;
-    return pThreadCache->Allocate(bytes);
+    ThreadCache* cache = GetThreadCache();
+    cache->BeginOwnOp();
+    return cache->Allocate(bytes);
   }
   // 大于256KB但小于1024KB(128页)，直接向PageHeap申请
   // 大于1024KB(128页)，直接向堆申请
   else {
     size_t pages = SizeMap::RoundUp(bytes) >> PAGE_SHIFT;
+    ThreadCache::CountCurrentPath(PATH_LARGE_ALLOC);
+    CONCUR_PROBE(large_alloc, pages, bytes);
+
+    Span* span = nullptr;
+    while (true) {
+      PageHeap::Instance().Mutex().lock();
+      span = PageHeap::Instance().New(pages);
+      PageHeap::Instance().Mutex().unlock();
+      if (span != nullptr) {
+        break;
+      }
+      // 超过硬上限，在锁外调用处理函数，放弃时抛出std::bad_alloc
+      PageHeap::Instance().HandleLimit(pages << PAGE_SHIFT);
+    }
+
+    void* ptr = (void*)(span->_start << PAGE_SHIFT);
+    return ptr;
+  }
+}
 
+// 释放慢路径：线程首次释放（对象由其他线程申请）时创建线程缓存，大于256KB直接向PageHeap释放
+void ConcurFreeSlow(void* ptr, size_t sizeClass) {
+  if (sizeClass != 0) {
+    ThreadCache* cache = GetThreadCache();
+    cache->BeginOwnOp();
+    cache->DeallocateIndex(ptr, sizeClass - 1);
+  } else if (pOwnCache != nullptr) {
+    // 开启异步释放的线程交给回收线程
+    pOwnCache->FreeLarge(ptr);
+  } else {
+    Span* span = PageHeap::Instance().ObjectToSpan(ptr);
     PageHeap::Instance().Mutex().lock();
-    Span* span = PageHeap::Instance().New(pages);
+    PageHeap::Instance().Delete(span);
     PageHeap::Instance().Mutex().unlock();
+  }
+}
 
-    void* ptr = (void*)(span->_start << PAGE_SHIFT);
+// 对外申请清零内存接口（代替calloc）
+void* ConcurCalloc(size_t num, size_t size) {
+  if (size != 0 && num > SIZE_MAX / size) {
+    throw std::bad_alloc();
+  }
+  // 大小为0时与malloc(0)一样返回可释放的最小对象
+  size_t bytes = std::max(num * size, (size_t)1);
+  void* ptr = ConcurAlloc(bytes);
+
+  // 小于256KB内存来自缓存的对象，头部存过链表指针，必须清零
+  if (bytes <= MAX_BYTES) {
+    memset(ptr, 0, bytes);
     return ptr;
   }
+
+  // 大块内存刚从系统申请或已归还系统时，页内容已知全零，跳过清零
+  Span* span = PageHeap::Instance().ObjectToSpan(ptr);
+  if (!span->_zeroed) {
+    size_t alignSize = (size_t)span->_size << PAGE_SHIFT;
+    if (alignSize >= (PAGE_NUM << PAGE_SHIFT)) {
+      // 超大块内存直接归还物理页，由缺页时内核提供零页，免去逐字节写入
+      SystemAllocator::Release(ptr, alignSize);
+    } else {
+      memset(ptr, 0, bytes);
+    }
+  }
+  return ptr;
 }
 
-// 对外释放内存接口（代替free）
-void ConcurFree(void* ptr) {
-  assert(ptr);
+// 对外重新分配内存接口（代替realloc）
+void* ConcurRealloc(void* ptr, size_t bytes) {
+  if (ptr == nullptr) {
+    return ConcurAlloc(bytes);
+  }
+  if (bytes == 0) {
+    ConcurFree(ptr);
+    return nullptr;
+  }
 
   Span* span = PageHeap::Instance().ObjectToSpan(ptr);
-  size_t objSize = span->_objSize;
+  size_t objSize = span->ObjSize();
+
+  if (span->_sizeClass != 0) {
+    // 新大小仍落在同一个对齐档位，原地返回
+    if (bytes <= MAX_BYTES && SizeMap::RoundUp(bytes) == objSize) {
+      return ptr;
+    }
+  } else if (bytes > MAX_BYTES) {
+    size_t pages = SizeMap::RoundUp(bytes) >> PAGE_SHIFT;
+    // 缩小不超过一半时原地返回，避免拷贝
+    if (pages <= span->_size) {
+      if (pages * 2 >= span->_size) {
+        return ptr;
+      }
+    } else {
+      // 扩大时尝试吸收后方空闲Span，或用mremap重新映射
+      bool grown = false;
+      {
+        std::lock_guard<ConcurMutex> lock(PageHeap::Instance().Mutex());
+        grown = PageHeap::Instance().Grow(span, pages);
+      }
 
-  // 小于256KB内存，缓存架构释放
-  if (objSize <= MAX_BYTES) {
-    assert(pThreadCache);
-    pThreadCache->Deallocate(ptr, objSize);
+      if (grown) {
+        return (void*)(span->_start << PAGE_SHIFT);
+      }
+    }
   }
-  // 大于256KB但小于1024KB(128页)，直接向PageHeap释放
-  // 大于1024KB(128页)，直接向堆释放
-  else {
-    PageHeap::Instance().Mutex().lock();
-    PageHeap::Instance().Delete(span);
-    PageHeap::Instance().Mutex().unlock();
+
+  // 无法原地调整，申请新内存并拷贝
+  void* newPtr = ConcurAlloc(bytes);
+  memcpy(newPtr, ptr, std::min(bytes, objSize));
+  ConcurFree(ptr);
+  return newPtr;
+}
+
+// 设置已提交内存的软上限与硬上限，0表示不限制
+void ConcurSetMemoryLimit(size_t softBytes, size_t hardBytes) {
+  PageHeap::Instance().Mutex().lock();
+  PageHeap::Instance().SetLimits(softBytes, hardBytes);
+  PageHeap::Instance().Mutex().unlock();
+}
+
+// 设置超过硬上限时调用的处理函数，nullptr表示直接抛出std::bad_alloc
+void ConcurSetLimitHandler(LimitHandler handler) { PageHeap::Instance().SetLimitHandler(handler); }
+
+// 获取页堆内存统计与上限命中次数
+HeapStats ConcurGetHeapStats() {
+  PageHeap::Instance().Mutex().lock();
+  HeapStats stats = PageHeap::Instance().Stats();
+  PageHeap::Instance().Mutex().unlock();
+  return stats;
+}
+
+// 设置大块内存缓存的字节上限，0表示不缓存
+void ConcurSetLargeCacheLimit(size_t bytes) {
+  PageHeap::Instance().Mutex().lock();
+  PageHeap::Instance().SetLargeCacheLimit(bytes);
+  PageHeap::Instance().Mutex().unlock();
+}
+
+// 将当前线程缓存的全部对象归还CentralCache
+void ConcurThreadCacheFlush() {
+  if (pOwnCache != nullptr) {
+    pOwnCache->Flush();
+  }
+}
+
+// 清空所有线程缓存，休眠线程的缓存由调用线程直接归还
+void ConcurThreadCacheFlushAll() { ThreadCache::FlushAll(); }
+
+// 设置线程缓存的闲置时长，超过该时长没有申请释放的线程缓存由其他线程取走归还，0表示不启用
+void ConcurSetThreadCacheDecay(size_t ms) { ThreadCache::SetDecay(ms); }
+
+// 设置CentralCache每个分片保留的完全空闲Span数，超出的归还页堆，0表示立即归还
+void ConcurSetEmptySpanLimit(size_t spans) {
+  CentralCache::Instance().SetEmptySpanLimit(spans);
+  if (spans == 0) {
+    CentralCache::Instance().ReleaseEmptySpans();
+  }
+}
+
+// 设置当前线程是否异步释放
+void ConcurSetAsyncFree(bool enable) {
+  GetThreadCache()->SetAsyncFree(enable);
+}
+
+// 当前线程因队列满而同步释放的次数
+size_t ConcurAsyncFreeFallbacks() {
+  return pOwnCache != nullptr ? pOwnCache->AsyncFallbacks() : 0;
+}
+
+// 进入读临界区
+void ConcurEpochEnter() {
+  GetThreadCache()->EnterEpoch();
+}
+
+// 退出读临界区，须与ConcurEpochEnter在同一线程配对
+void ConcurEpochExit() {
+  assert(pOwnCache != nullptr);
+  pOwnCache->ExitEpoch();
+}
+
+// 退休一个对象，所有线程都经过当前纪元后释放
+void ConcurRetire(void* ptr) {
+  assert(ptr);
+  GetThreadCache()->Retire(ptr);
+}
+
+// 尝试推进纪元并释放当前线程已安全的退休对象
+size_t ConcurEpochReclaim() {
+  return pOwnCache != nullptr ? pOwnCache->ReclaimRetired() : 0;
+}
+
+// 设置新申请的小对象Span是否用位图管理空闲对象
+void ConcurSetBitmapSpans(bool enable) { CentralCache::Instance().SetBitmapSpans(enable); }
+
+// 预先向系统映射bytes字节挂入页堆，可选预先触发缺页或锁定物理内存
+bool ConcurReserve(size_t bytes, bool populate, bool lock) {
+  PageHeap::Instance().Mutex().lock();
+  bool reserved = PageHeap::Instance().Reserve(bytes, populate, lock);
+  PageHeap::Instance().Mutex().unlock();
+  return reserved;
+}
+
+// 为当前线程预先缓存profile中各大小的对象，并跳过慢启动
+void ConcurPrewarm(const PrewarmEntry* profile, size_t n) {
+  ThreadCache* cache = GetThreadCache();
+  for (size_t i = 0; i < n; ++i) {
+    if (profile[i]._bytes > 0 && profile[i]._bytes <= MAX_BYTES) {
+      cache->Prewarm(profile[i]._bytes, profile[i]._count);
+    }
   }
-}
\ No newline at end of file
+}
+
+// 汇总所有线程的路径计数
+PathStats ConcurGetPathStats() { return ThreadCache::CollectPathStats(); }
+
+// 打印PageHeap锁与CentralCache各哈希桶锁的竞争统计（需编译时定义CONCUR_LOCK_PROFILE）
+void ConcurDumpLockProfile() {
+#ifdef CONCUR_LOCK_PROFILE
+  ProfiledMutex::Sample samples[ProfiledMutex::SAMPLE_NUM];
+  size_t sampleNum = 0;
+  ProfiledMutex::Stats stats = PageHeap::Instance().Mutex().Snapshot(samples, &sampleNum);
+  ProfiledMutex::Print("PageHeap", stats, samples, sampleNum);
+  CentralCache::Instance().DumpLockProfile(10);
+#else
+  printf("未启用锁竞争统计，请使用make profile编译（定义CONCUR_LOCK_PROFILE）\n");
+#endif
+}
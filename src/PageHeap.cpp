@@ -1,119 +1,495 @@
 #include "PageHeap.h"
 
+#include "AsyncFree.h"
+#include "CentralCache.h"
+#include "ThreadCache.h"
+
 // 分配一个对应大小的Span到CentralCache
 Span* PageHeap::New(size_t pages) {
-  // 直接向堆申请
+  assert(pages > 0);
   if (pages > PAGE_NUM) {
-    Span* span = spanPool.New();
-    void* ptr = SystemAllocator::Alloc(pages << PAGE_SHIFT);
+    ScavengeLargeSpans();
+  }
 
+  Span* span = FindFree(pages);
+  if (span != nullptr && span->_zeroed && !ReserveBytes(pages << PAGE_SHIFT)) {
+    // 已释放物理内存的页重新使用时同样计入已提交字节数
+    return nullptr;
+  }
+  if (span == nullptr) {
+    // 向系统申请，不足PAGE_NUM页时按PAGE_NUM页申请，再与相邻空闲Span合并；
+    // 每次请求只按所需页数检查一次上限，与非全零的Span合并后整段都计入已提交字节数，
+    // 按PAGE_NUM页映射会超过硬上限时只映射所需的页数
+    if (!ReserveBytes(pages << PAGE_SHIFT)) {
+      return nullptr;
+    }
+    size_t allocPages = std::max(pages, PAGE_NUM);
+    if (!WithinHardLimit(allocPages << PAGE_SHIFT)) {
+      allocPages = pages;
+    }
+    void* ptr = nullptr;
+    try {
+      ptr = SystemAlloc(allocPages << PAGE_SHIFT);
+    } catch (const std::bad_alloc&) {
+      ++_stats._mapFailures;
+      return nullptr;
+    }
+    _stats._mappedBytes += allocPages << PAGE_SHIFT;
+
+    span = spanPool.New();
     span->_start = (uintptr_t)ptr >> PAGE_SHIFT;
+    span->_size = allocPages;
+    span->_zeroed = true;
+    Merge(span);
+
+    span = FindFree(pages);
+    assert(span);
+  }
+
+  return Carve(span, pages);
+}
+
+// 从CentralCache释放一个对应大小的Span
+void PageHeap::Delete(Span* span) {
+  assert(span && span->_inUse);
+  // 归还的Span已被使用过，内容不再是全零
+  span->_zeroed = false;
+  // 清除小对象Span的哈希桶标记，空闲Span的_sizeClass始终为0
+  if (span->_sizeClass != 0) {
+    for (size_t i = 0; i < span->_size; ++i) {
+      _classMap.set(span->_start + i, 0);
+    }
+    span->_sizeClass = 0;
+  }
+
+  Merge(span);
+  if (span->_size > PAGE_NUM) {
+    ScavengeLargeSpans();
+  }
+}
+
+// 原地扩展一个使用中的Span到pages页，失败返回false
+bool PageHeap::Grow(Span* span, size_t pages) {
+  assert(span && span->_inUse);
+  if (pages <= span->_size) {
+    return true;
+  }
+
+  // 吸收后方相邻的空闲Span
+  size_t extra = pages - span->_size;
+  Span* nextSpan = (Span*)_idSpanMap.get(span->_start + span->_size);
+  if (nextSpan != nullptr && !nextSpan->_inUse && nextSpan->_size >= extra) {
+    // 吸收已归还物理内存的页同样计入已提交字节数
+    if (nextSpan->_zeroed && !ReserveBytes(extra << PAGE_SHIFT)) {
+      return false;
+    }
+    RemoveFree(nextSpan);
+    if (nextSpan->_size == extra) {
+      spanPool.Delete(nextSpan);
+    } else {
+      nextSpan->_start += extra;
+      nextSpan->_size -= extra;
+      MapSpan(nextSpan);
+      InsertFree(nextSpan);
+    }
+
     span->_size = pages;
-    _idSpanMap.set(span->_start, span);
+    MapSpan(span);
+    return true;
+  }
 
-    span->_inUse = true;
-    return span;
+#ifdef CONCUR_ARENA_BITS
+  // 预留地址模式下不能搬移到预留区间之外，只有位于已提交部分末尾的Span可以原地提交更多页
+  if (((span->_start + span->_size) << PAGE_SHIFT) == _arenaTop) {
+    if (!ReserveBytes(extra << PAGE_SHIFT)) {
+      return false;
+    }
+    try {
+      SystemAlloc(extra << PAGE_SHIFT);
+    } catch (const std::bad_alloc&) {
+      ++_stats._mapFailures;
+      return false;
+    }
+    _stats._mappedBytes += extra << PAGE_SHIFT;
+    span->_size = pages;
+    MapSpan(span);
+    return true;
   }
+#else
+  // 扩展到超过PAGE_NUM页时用mremap，地址可能改变但无需拷贝；不足PAGE_NUM页的Span是从
+  // PAGE_NUM页的映射中切出的，倍增扩容越过PAGE_NUM时后方已没有足够的空闲页可吸收，
+  // 所以按新大小而不是原大小判断。Span位于更大的映射中间时mremap把这些页整体移出，
+  // 原地址段留下的空洞不属于任何Span，相邻的空闲Span不会与之合并
+  if (pages > PAGE_NUM) {
+    if (!ReserveBytes(extra << PAGE_SHIFT)) {
+      return false;
+    }
+    void* oldPtr = (void*)(span->_start << PAGE_SHIFT);
+    void* newPtr = nullptr;
+    try {
+      // 无法原地扩展时先映射目标地址，映射失败抛出std::bad_alloc
+      newPtr = SystemAllocator::Realloc(oldPtr, (size_t)span->_size << PAGE_SHIFT,
+                                        pages << PAGE_SHIFT);
+    } catch (const std::bad_alloc&) {
+    }
+    if (newPtr == nullptr) {
+      ++_stats._mapFailures;
+      return false;
+    }
+    _stats._mappedBytes += extra << PAGE_SHIFT;
 
-  if (!_spanLists[pages].Empty()) {
-    Span* span = _spanLists[pages].PopFront();
-    span->_inUse = true;
-    return span;
-  } else {
-    // 向后寻找大Span(n)，将其切成Span(k)和Span(n-k)
-    for (size_t i = pages + 1; i <= PAGE_NUM; ++i) {
-      if (!_spanLists[i].Empty()) {
-        Span* kSpan = spanPool.New();            // k页
-        Span* nSpan = _spanLists[i].PopFront();  // n页
-
-        kSpan->_start = nSpan->_start;
-        kSpan->_size = pages;
-        // 标记页映射
-        for (size_t i = 0; i < kSpan->_size; ++i) {
-          _idSpanMap.set(kSpan->_start + i, kSpan);
-        }
-
-        nSpan->_start += pages;
-        nSpan->_size -= pages;
-
-        _spanLists[nSpan->_size].PushFront(nSpan);
-        kSpan->_inUse = true;
-        return kSpan;
+    // 原地址段已不属于堆，清除其全部页映射，避免残留指针被相邻Span合并时读到
+    if (newPtr != oldPtr) {
+      for (size_t i = 0; i < span->_size; ++i) {
+        _idSpanMap.set(span->_start + i, nullptr);
       }
     }
+    span->_start = (uintptr_t)newPtr >> PAGE_SHIFT;
+    span->_size = pages;
+    MapSpan(span);
+    return true;
   }
+#endif
+  return false;
+}
 
-  // 若全为空，则向系统申请一个大Span
-  void* ptr = SystemAllocator::Alloc(PAGE_NUM << PAGE_SHIFT);
-  Span* hugeSpan = spanPool.New();
+// 向系统申请bytes字节，失败抛出std::bad_alloc
+void* PageHeap::SystemAlloc(size_t bytes) {
+  ThreadCache::CountCurrentPath(PATH_MMAP);
+  CONCUR_PROBE(mmap, bytes >> PAGE_SHIFT, _stats._mappedBytes >> PAGE_SHIFT);
+#ifdef CONCUR_ARENA_BITS
+  // 预留地址只增不减，归还的页经madvise释放物理内存后仍留在空闲结构中复用
+  if (bytes > _arenaBase + ((size_t)1 << ARENA_BITS) - _arenaTop ||
+      !SystemAllocator::Commit((void*)_arenaTop, bytes)) {
+    throw std::bad_alloc();
+  }
+  void* ptr = (void*)_arenaTop;
+  _arenaTop += bytes;
+  return ptr;
+#else
+  return SystemAllocator::Alloc(bytes);
+#endif
+}
 
-  hugeSpan->_start = (uintptr_t)ptr >> PAGE_SHIFT;
-  hugeSpan->_size = PAGE_NUM;
-  // 标记页映射
-  for (size_t i = 0; i < hugeSpan->_size; ++i) {
-    _idSpanMap.set(hugeSpan->_start + i, hugeSpan);
+// 预先向系统映射bytes字节并挂入空闲结构，之后的New无需mmap
+bool PageHeap::Reserve(size_t bytes, bool populate, bool lock) {
+  size_t pages = (bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+  if (pages == 0) {
+    return true;
+  }
+  if (!ReserveBytes(pages << PAGE_SHIFT)) {
+    return false;
   }
+  void* ptr = nullptr;
+  try {
+    ptr = SystemAlloc(pages << PAGE_SHIFT);
+  } catch (const std::bad_alloc&) {
+    ++_stats._mapFailures;
+    return false;
+  }
+  bool populated = true;
+  if (populate || lock) {
+    populated = SystemAllocator::Populate(ptr, pages << PAGE_SHIFT, lock);
+  }
+  _stats._mappedBytes += pages << PAGE_SHIFT;
+  _reservedBytes += pages << PAGE_SHIFT;
 
-  _spanLists[hugeSpan->_size].PushFront(hugeSpan);
-  return New(pages);  // 递归复用
+  Span* span = spanPool.New();
+  span->_start = (uintptr_t)ptr >> PAGE_SHIFT;
+  span->_size = pages;
+  // 预填充的页已占用物理内存，不再视为全零
+  span->_zeroed = !(populate || lock);
+  Merge(span);
+  return populated;
 }
 
-// 从CentralCache释放一个对应大小的Span
-void PageHeap::Delete(Span* span) {
-  assert(span);
-  // 直接向堆释放
-  size_t pages = span->_size;
-  if (pages > PAGE_NUM) {
-    void* ptr = (void*)(span->_start << PAGE_SHIFT);
-    SystemAllocator::Free(ptr, pages << PAGE_SHIFT);
-    spanPool.Delete(span);
-    return;
+// 设置超过PAGE_NUM页的空闲Span占用物理内存的字节上限，0表示立即归还系统
+void PageHeap::SetLargeCacheLimit(size_t bytes) {
+  _largeLimit = bytes;
+  ScavengeLargeSpans();
+}
+
+// 统计长度不小于minPages的空闲Span的总页数
+size_t PageHeap::FreePages(size_t minPages) {
+  size_t pages = 0;
+  for (size_t i = std::max(minPages, (size_t)1); i <= PAGE_NUM; ++i) {
+    for (Span* cur = _spanLists[i].Begin(); cur != _spanLists[i].End(); cur = cur->_next) {
+      pages += i;
+    }
   }
+  for (Span* span : _largeSpans) {
+    if (span->_size >= minPages) {
+      pages += span->_size;
+    }
+  }
+  return pages;
+}
 
+// 标记页映射：超过PAGE_NUM页的Span只标记首尾页，供释放和相邻合并查找
+// 逐页标记大块Span在合并和切分时都是O(页数)；内部页的残留映射不清除，ObjectToSpan只接受起始指针
+void PageHeap::MapSpan(Span* span) {
+  if (span->_size > PAGE_NUM) {
+    _idSpanMap.set(span->_start, span);
+    _idSpanMap.set(span->_start + span->_size - 1, span);
+  } else {
+    for (size_t i = 0; i < span->_size; ++i) {
+      _idSpanMap.set(span->_start + i, span);
+    }
+  }
+}
+
+// 与前后相邻的空闲Span合并后挂入空闲结构
+void PageHeap::Merge(Span* span) {
+  size_t merged = 0;
   // 向前合并
   while (true) {
-    uintptr_t prevId = span->_start - 1;
-    Span* prevSpan = (Span*)_idSpanMap.get(prevId);
-
-    if (prevSpan == nullptr) {
-      break;
-    } else if (prevSpan->_inUse) {
-      break;
-    } else if (prevSpan->_size + span->_size > PAGE_NUM) {
+    Span* prevSpan = (Span*)_idSpanMap.get(span->_start - 1);
+    if (prevSpan == nullptr || prevSpan->_inUse) {
       break;
     }
 
+    ++merged;
+    RemoveFree(prevSpan);
     span->_start = prevSpan->_start;
     span->_size += prevSpan->_size;
-
-    _spanLists[prevSpan->_size].Remove(prevSpan);
+    span->_zeroed = span->_zeroed && prevSpan->_zeroed;
     spanPool.Delete(prevSpan);
   }
   // 向后合并
   while (true) {
-    uintptr_t nextId = span->_start + span->_size;
-    Span* nextSpan = (Span*)_idSpanMap.get(nextId);
-
-    if (nextSpan == nullptr) {
-      break;
-    } else if (nextSpan->_inUse) {
-      break;
-    } else if (nextSpan->_size + span->_size > PAGE_NUM) {
+    Span* nextSpan = (Span*)_idSpanMap.get(span->_start + span->_size);
+    if (nextSpan == nullptr || nextSpan->_inUse) {
       break;
     }
 
+    ++merged;
+    RemoveFree(nextSpan);
     span->_size += nextSpan->_size;
-
-    _spanLists[nextSpan->_size].Remove(nextSpan);
+    span->_zeroed = span->_zeroed && nextSpan->_zeroed;
     spanPool.Delete(nextSpan);
   }
+  if (merged > 0) {
+    ThreadCache::CountCurrentPath(PATH_COALESCE, merged);
+    CONCUR_PROBE(coalesce, merged, span->_size);
+  }
 
-  // 标记页映射
-  for (size_t i = 0; i < span->_size; ++i) {
-    _idSpanMap.set(span->_start + i, span);
+  MapSpan(span);
+  if (span->_size > PAGE_NUM) {
+    span->_idleTime = NowMs();
+  }
+  InsertFree(span);
+}
+
+// 从空闲Span头部切出pages页，剩余部分挂回空闲结构
+Span* PageHeap::Carve(Span* span, size_t pages) {
+  RemoveFree(span);
+
+  if (span->_size > pages) {
+    ThreadCache::CountCurrentPath(PATH_HEAP_SPLIT);
+    CONCUR_PROBE(heap_split, pages, span->_size);
+    Span* restSpan = spanPool.New();
+    restSpan->_start = span->_start + pages;
+    restSpan->_size = span->_size - pages;
+    restSpan->_zeroed = span->_zeroed;
+    restSpan->_idleTime = span->_idleTime;
+    MapSpan(restSpan);
+    InsertFree(restSpan);
+
+    span->_size = pages;
   }
-  _spanLists[span->_size].PushFront(span);
+
+  MapSpan(span);
+  span->_inUse = true;
+  return span;
+}
+
+void PageHeap::InsertFree(Span* span) {
   span->_inUse = false;
+  if (span->_size <= PAGE_NUM) {
+    _spanLists[span->_size].PushFront(span);
+    _spanBitmap[span->_size >> 6] |= (uint64_t)1 << (span->_size & 63);
+  } else {
+    _largeSpans.insert(span);
+    if (!span->_zeroed) {
+      _largeBytes += (size_t)span->_size << PAGE_SHIFT;
+      // 空闲的大块Span不在任何SpanList中，借用_prev/_next按闲置时间排序；
+      // 新合并的Span闲置时间最新，直接插入头部，切分剩下的部分向后找到位置
+      Span* pos = _largeIdle.Begin();
+      while (pos != _largeIdle.End() && (int32_t)(pos->_idleTime - span->_idleTime) > 0) {
+        pos = pos->_next;
+      }
+      _largeIdle.Insert(pos, span);
+    }
+  }
+  if (span->_zeroed) {
+    _zeroBytes += (size_t)span->_size << PAGE_SHIFT;
+  }
+}
+
+void PageHeap::RemoveFree(Span* span) {
+  if (span->_size <= PAGE_NUM) {
+    _spanLists[span->_size].Remove(span);
+    if (_spanLists[span->_size].Empty()) {
+      _spanBitmap[span->_size >> 6] &= ~((uint64_t)1 << (span->_size & 63));
+    }
+  } else {
+    _largeSpans.erase(span);
+    if (!span->_zeroed) {
+      _largeBytes -= (size_t)span->_size << PAGE_SHIFT;
+      _largeIdle.Remove(span);
+    }
+  }
+  if (span->_zeroed) {
+    _zeroBytes -= (size_t)span->_size << PAGE_SHIFT;
+  }
+}
+
+// 最佳适配：先按位图O(1)找到不小于pages的最小非空桶，再到有序集合中O(log n)查找
+Span* PageHeap::FindFree(size_t pages) {
+  if (pages <= PAGE_NUM) {
+    size_t i = pages >> 6;
+    uint64_t word = _spanBitmap[i] & (~(uint64_t)0 << (pages & 63));
+    while (true) {
+      if (word != 0) {
+        return _spanLists[(i << 6) + CountTrailingZeros(word)].Begin();
+      }
+      if (++i == BITMAP_WORDS) {
+        break;
+      }
+      word = _spanBitmap[i];
+    }
+  }
+
+  Span key;
+  key._size = pages;
+  auto it = _largeSpans.lower_bound(&key);
+  if (it == _largeSpans.end()) {
+    return nullptr;
+  }
+  return *it;
+}
+
+// 从闲置最久的大块空闲Span开始归还系统：超出上限时归还至上限以内，到了检查时刻时归还闲置过久的；
+// 链表按闲置时间排序，遇到未过期的Span且不超过上限即停止，每次调用不会遍历全部空闲Span
+// 只释放物理页，保留映射以便继续合并和复用；缓存不低于Reserve预留的字节数
+void PageHeap::ScavengeLargeSpans() {
+  uint32_t now = NowMs();
+  size_t limit = std::max(_largeLimit, _reservedBytes);
+  bool timed = (int32_t)(now - _nextScavengeMs) >= 0;
+  if (!timed && _largeBytes <= limit) {
+    return;
+  }
+  if (timed) {
+    _nextScavengeMs = now + LARGE_SCAVENGE_MS;
+  }
+
+  Span* span = _largeIdle.End()->_prev;
+  while (span != _largeIdle.End()) {
+    Span* newer = span->_prev;
+    bool expired = timed && (uint32_t)(now - span->_idleTime) >= LARGE_CACHE_MS;
+    if (!expired && _largeBytes <= limit) {
+      break;
+    }
+    // 预留的页可能已与相邻Span合并，只归还不会使缓存低于预留字节数的Span
+    if (_largeBytes >= _reservedBytes + ((size_t)span->_size << PAGE_SHIFT)) {
+      ReleaseFree(span);
+    }
+    span = newer;
+  }
+}
+
+// 线程缓存的闲置检查调用，锁被占用时跳过，由持锁的一方或下一次检查处理
+void PageHeap::ScavengeIdle() {
+  if (_mutex.try_lock()) {
+    ScavengeLargeSpans();
+    _mutex.unlock();
+  }
+}
+
+// 归还span的物理页，span须在空闲结构中
+// _zeroed不参与排序，可以在集合中原地修改
+void PageHeap::ReleaseFree(Span* span) {
+  assert(!span->_inUse && !span->_zeroed);
+  size_t bytes = (size_t)span->_size << PAGE_SHIFT;
+  SystemAllocator::Release((void*)(span->_start << PAGE_SHIFT), bytes);
+  span->_zeroed = true;
+  _zeroBytes += bytes;
+  if (span->_size > PAGE_NUM) {
+    _largeBytes -= bytes;
+    _largeIdle.Remove(span);
+  }
+}
+
+// 再映射bytes字节前检查上限，每次请求最多调用一次。超过软上限时请求清空线程缓存，
+// 并只归还回到软上限以下所需的空闲页；停留在软上限之上时每LARGE_SCAVENGE_MS最多归还一次，
+// 线程缓存与CentralCache归还的页留到下一次。超过硬上限返回false
+bool PageHeap::ReserveBytes(size_t bytes) {
+  if (_softLimit != 0 && Committed() + bytes > _softLimit) {
+    ++_stats._softLimitHits;
+    uint32_t now = NowMs();
+    if (!_aboveSoftLimit || (int32_t)(now - _nextSoftReleaseMs) >= 0) {
+      _aboveSoftLimit = true;
+      _nextSoftReleaseMs = now + LARGE_SCAVENGE_MS;
+      ThreadCache::RequestFlushAll();
+      CentralCache::Instance().RequestReleaseEmpty();
+      ReleaseFreeTo(_softLimit > bytes ? _softLimit - bytes : 0);
+    }
+  } else {
+    _aboveSoftLimit = false;
+  }
+
+  if (!WithinHardLimit(bytes)) {
+    ++_stats._hardLimitHits;
+    return false;
+  }
+  return true;
+}
+
+// 归还空闲页直到已提交字节数不超过target：先从闲置最久的大块Span开始，
+// 再按页数从大到小归还，每次系统调用归还尽量多的页
+void PageHeap::ReleaseFreeTo(size_t target) {
+  Span* span = _largeIdle.End()->_prev;
+  while (span != _largeIdle.End() && Committed() > target) {
+    Span* newer = span->_prev;
+    ReleaseFree(span);
+    span = newer;
+  }
+  for (size_t i = PAGE_NUM; i >= 1 && Committed() > target; --i) {
+    for (Span* cur = _spanLists[i].Begin(); cur != _spanLists[i].End() && Committed() > target;
+         cur = cur->_next) {
+      if (!cur->_zeroed) {
+        ReleaseFree(cur);
+      }
+    }
+  }
+}
+
+// 设置已提交内存的软上限与硬上限，0表示不限制
+void PageHeap::SetLimits(size_t softBytes, size_t hardBytes) {
+  _softLimit = softBytes;
+  _hardLimit = hardBytes;
+}
+
+void PageHeap::SetLimitHandler(LimitHandler handler) { _limitHandler = handler; }
+
+HeapStats PageHeap::Stats() {
+  HeapStats stats = _stats;
+  stats._committedBytes = Committed();
+  return stats;
+}
+
+// New返回nullptr后在锁外调用：有处理函数且其返回true时返回，否则抛出std::bad_alloc
+void PageHeap::HandleLimit(size_t bytes) {
+  // 先释放异步释放队列中尚未处理的内存，再归还CentralCache保留的空闲Span，有进展则直接重试；
+  // 队列与保留的Span都已清空时下一次不会再返回
+  size_t drained = AsyncReclaimer::Instance().DrainNow();
+  if (CentralCache::Instance().ReleaseEmptySpans() > 0 || drained > 0) {
+    return;
+  }
+  LimitHandler handler = _limitHandler;
+  if (handler == nullptr || !handler(bytes)) {
+    throw std::bad_alloc();
+  }
 }
 
 // 将对象Object映射到对应的Span
@@ -122,7 +498,19 @@ Span* PageHeap::ObjectToSpan(void* obj) {
   // 基数树PageMap读写分离，所以可以无锁访问
   // 计算对象所属页号
   uintptr_t start = (uintptr_t)obj >> PAGE_SHIFT;
-  return (Span*)_idSpanMap.get(start);
+  Span* span = (Span*)_idSpanMap.get(start);
+  // 大块Span内部页的映射可能是残留的旧Span
+  assert(span == nullptr || (start >= span->_start && start < span->_start + span->_size));
+  return span;
+}
+
+// 记录小对象Span每一页的哈希桶下标，释放时无需访问Span
+void PageHeap::SetSizeClass(Span* span, size_t index) {
+  assert(index < LIST_NUM - 1);
+  span->_sizeClass = (uint8_t)(index + 1);
+  for (size_t i = 0; i < span->_size; ++i) {
+    _classMap.set(span->_start + i, (uint8_t)(index + 1));
+  }
 }
 
-std::mutex& PageHeap::Mutex() { return _mutex; }
\ No newline at end of file
+ConcurMutex& PageHeap::Mutex() { return _mutex; }
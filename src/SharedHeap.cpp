@@ -0,0 +1,246 @@
+#include "SharedHeap.h"
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// 创建共享堆，初始化控制块、进程间互斥锁与一个覆盖全部数据页的空闲块
+SharedHeap* SharedHeap::Create(const char* name, size_t bytes, int* fd) {
+  size_t pageCount = (bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+  size_t headerBytes = sizeof(SharedHeap) + pageCount * sizeof(PageInfo);
+  size_t firstPage = (headerBytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+  if (pageCount <= firstPage || pageCount >= NONE) {
+    return nullptr;
+  }
+  bytes = pageCount << PAGE_SHIFT;
+
+  int memfd = memfd_create(name, 0);
+  if (memfd < 0) {
+    return nullptr;
+  }
+  if (ftruncate(memfd, bytes) != 0) {
+    close(memfd);
+    return nullptr;
+  }
+  // 先预留按PAGE_SHIFT对齐的地址再覆盖映射，mmap本身只保证按系统页(4KB)对齐
+  void* ptr = nullptr;
+  try {
+    ptr = SystemAllocator::Reserve(bytes);
+  } catch (const std::bad_alloc&) {
+    close(memfd);
+    return nullptr;
+  }
+  if (mmap(ptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED) {
+    munmap(ptr, bytes);
+    close(memfd);
+    return nullptr;
+  }
+
+  // 新映射的页全为零，无需清零元数据
+  SharedHeap* heap = (SharedHeap*)ptr;
+  heap->_magic = MAGIC;
+  heap->_base = (uintptr_t)ptr;
+  heap->_bytes = bytes;
+  heap->_pageCount = (uint32_t)pageCount;
+  heap->_firstPage = (uint32_t)firstPage;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&heap->_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  for (uint32_t& head : heap->_freeHeads) {
+    head = NONE;
+  }
+  heap->InsertFree(heap->_firstPage, heap->_pageCount - heap->_firstPage);
+
+  if (fd != nullptr) {
+    *fd = memfd;
+  } else {
+    close(memfd);
+  }
+  return heap;
+}
+
+// 先只读映射控制块取得创建者的地址与大小，再映射整个区域到同一地址
+SharedHeap* SharedHeap::Attach(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SharedHeap)) {
+    return nullptr;
+  }
+  void* header = mmap(nullptr, sizeof(SharedHeap), PROT_READ, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) {
+    return nullptr;
+  }
+  const SharedHeap* view = (const SharedHeap*)header;
+  bool valid = view->_magic == MAGIC && view->_bytes == (size_t)st.st_size;
+  uintptr_t base = view->_base;
+  size_t bytes = view->_bytes;
+  munmap(header, sizeof(SharedHeap));
+  if (!valid) {
+    return nullptr;
+  }
+
+  void* ptr = mmap((void*)base, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+                   fd, 0);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+  // 旧内核不认识MAP_FIXED_NOREPLACE时只把地址当作提示
+  if (ptr != (void*)base) {
+    munmap(ptr, bytes);
+    return nullptr;
+  }
+  return (SharedHeap*)ptr;
+}
+
+void SharedHeap::Detach(SharedHeap* heap) {
+  assert(heap);
+  munmap(heap, heap->_bytes);
+}
+
+void* SharedHeap::Alloc(size_t bytes) {
+  size_t pages = bytes == 0 ? 1 : (bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+  if (pages >= _pageCount) {
+    return nullptr;
+  }
+  PageInfo* info = Pages();
+
+  if (!Lock()) {
+    return nullptr;
+  }
+  // 先在精确分桶中找页数最接近的空闲块，再在大块链表中最佳适配
+  uint32_t found = NONE;
+  for (size_t i = pages; i < PAGE_NUM && found == NONE; ++i) {
+    found = _freeHeads[i];
+  }
+  if (found == NONE) {
+    for (uint32_t cur = _freeHeads[PAGE_NUM]; cur != NONE; cur = info[cur]._next) {
+      if (info[cur]._size >= pages && (found == NONE || info[cur]._size < info[found]._size)) {
+        found = cur;
+      }
+    }
+  }
+  if (found == NONE) {
+    Unlock();
+    return nullptr;
+  }
+
+  RemoveFree(found);
+  uint32_t size = info[found]._size;
+  if (size > pages) {
+    InsertFree(found + (uint32_t)pages, size - (uint32_t)pages);
+  }
+  SetBlock(found, (uint32_t)pages, false);
+  Unlock();
+
+  return (void*)(_base + ((uintptr_t)found << PAGE_SHIFT));
+}
+
+bool SharedHeap::Free(void* ptr) {
+  assert(Contains(ptr));
+  assert(((uintptr_t)ptr & ((1 << PAGE_SHIFT) - 1)) == 0);
+  uint32_t page = (uint32_t)(((uintptr_t)ptr - _base) >> PAGE_SHIFT);
+  PageInfo* info = Pages();
+
+  if (!Lock()) {
+    return false;
+  }
+  assert(!info[page]._free);
+  uint32_t size = info[page]._size;
+  uint32_t end = page + size;
+
+  // 前一个块的尾页与后一个块的首页都记录了边界标记
+  if (page > _firstPage && info[page - 1]._free) {
+    uint32_t left = page - info[page - 1]._size;
+    RemoveFree(left);
+    size += info[left]._size;
+    page = left;
+  }
+  if (end < _pageCount && info[end]._free) {
+    RemoveFree(end);
+    size += info[end]._size;
+  }
+  InsertFree(page, size);
+  Unlock();
+  return true;
+}
+
+bool SharedHeap::Contains(const void* ptr) const {
+  uintptr_t addr = (uintptr_t)ptr;
+  return addr >= _base + ((uintptr_t)_firstPage << PAGE_SHIFT) && addr < _base + _bytes;
+}
+
+size_t SharedHeap::FreePages() {
+  PageInfo* info = Pages();
+  size_t pages = 0;
+  if (!Lock()) {
+    return 0;
+  }
+  for (uint32_t head : _freeHeads) {
+    for (uint32_t cur = head; cur != NONE; cur = info[cur]._next) {
+      pages += info[cur]._size;
+    }
+  }
+  Unlock();
+  return pages;
+}
+
+// 持锁进程异常退出时，它可能正在摘链或写边界标记，元数据已不可信：
+// 先标记损坏再恢复锁的一致性，其他进程随后加锁时看到标记直接失败，不会在半更新的链表上继续操作
+bool SharedHeap::Lock() {
+  if (pthread_mutex_lock(&_mutex) == EOWNERDEAD) {
+    __atomic_store_n(&_poisoned, 1, __ATOMIC_RELEASE);
+    pthread_mutex_consistent(&_mutex);
+  }
+  if (_poisoned) {
+    Unlock();
+    return false;
+  }
+  return true;
+}
+
+void SharedHeap::InsertFree(uint32_t page, uint32_t size) {
+  PageInfo* info = Pages();
+  SetBlock(page, size, true);
+  uint32_t& head = _freeHeads[size < PAGE_NUM ? size : PAGE_NUM];
+  info[page]._prev = NONE;
+  info[page]._next = head;
+  if (head != NONE) {
+    info[head]._prev = page;
+  }
+  head = page;
+}
+
+void SharedHeap::RemoveFree(uint32_t page) {
+  PageInfo* info = Pages();
+  assert(info[page]._free);
+  uint32_t size = info[page]._size;
+  uint32_t& head = _freeHeads[size < PAGE_NUM ? size : PAGE_NUM];
+  if (info[page]._prev != NONE) {
+    info[info[page]._prev]._next = info[page]._next;
+  } else {
+    head = info[page]._next;
+  }
+  if (info[page]._next != NONE) {
+    info[info[page]._next]._prev = info[page]._prev;
+  }
+  info[page]._free = 0;
+}
+
+void SharedHeap::SetBlock(uint32_t page, uint32_t size, bool free) {
+  PageInfo* info = Pages();
+  info[page]._size = size;
+  info[page]._free = free;
+  info[page + size - 1]._size = size;
+  info[page + size - 1]._free = free;
+}
+#endif
@@ -1,33 +1,32 @@
 #include "ThreadCache.h"
 
+#include "AsyncFree.h"
 #include "CentralCache.h"
+#include "PageHeap.h"
 
-void* ThreadCache::Allocate(size_t bytes) {
-  assert(bytes <= MAX_BYTES);
+CONCUR_TLS std::atomic<ThreadCache*> pThreadCache{nullptr};
+CONCUR_TLS std::atomic<size_t> tcOpSeq{0};
 
-  size_t index = SizeMap::Index(bytes);
-  FreeList& list = _freeLists[index];
+ThreadCache* ThreadCache::_caches = nullptr;
+std::mutex ThreadCache::_cachesMutex;
+std::atomic<size_t> ThreadCache::_decayMs{THREAD_CACHE_DECAY_MS};
+std::atomic<size_t> ThreadCache::_orphanPathCounts[PATH_NUM];
+void* ThreadCache::_orphanLimbo[EPOCH_LIMBO_NUM] = {};
+size_t ThreadCache::_orphanLimboEpoch[EPOCH_LIMBO_NUM] = {};
+alignas(CACHE_LINE_SIZE) std::atomic<size_t> ThreadCache::_globalEpoch{0};
 
-  if (!list.Empty()) {
-    return list.Pop();
-  } else {
-    size_t alignSize = SizeMap::RoundUp(bytes);
-    return FetchFromCentralCache(list, alignSize);
+// 按线程创建顺序轮流分配CentralCache分片，并登记到线程缓存链表。在所属线程中构造
+ThreadCache::ThreadCache() : _cacheSlot(&pThreadCache), _opSeq(&tcOpSeq) {
+  static std::atomic<size_t> threadCount{0};
+  _shard = threadCount.fetch_add(1, std::memory_order_relaxed) % CENTRAL_SHARDS;
+  _scavengeMs = NowMs();
+  for (std::atomic<size_t>& count : _pathCounts) {
+    count.store(0, std::memory_order_relaxed);
   }
-}
-
-void ThreadCache::Deallocate(void* ptr, size_t bytes) {
-  assert(ptr);
-  assert(bytes <= MAX_BYTES);
-
-  size_t index = SizeMap::Index(bytes);
-  FreeList& list = _freeLists[index];
-  list.Push(ptr);
 
-  if (list.Size() > list.MaxSize()) {
-    size_t alignSize = SizeMap::RoundUp(bytes);
-    ReleaseToCentralCache(list, alignSize);
-  }
+  std::lock_guard<std::mutex> lock(_cachesMutex);
+  _nextCache = _caches;
+  _caches = this;
 }
 
 // 从CentralCache获取批量对应大小的对象
@@ -35,33 +34,450 @@ void* ThreadCache::FetchFromCentralCache(FreeList& list, size_t objSize) {
   assert(objSize <= MAX_BYTES);
   // Slow Start慢启动
   // FreeList初期对象少就分配少，后期对象多再按SizeMap规则分配
+  // 达到一批后链表仍被取空，说明工作集更大，按批扩大上限，多出的部分由低水位回收
   size_t& maxSize = list.MaxSize();
-  size_t batchNum = std::min(SizeMap::ObjectMoveNum(objSize), maxSize);
-  if (batchNum == maxSize) {
+  size_t moveNum = SizeMap::ObjectMoveNum(objSize);
+  size_t batchNum = std::min(moveNum, maxSize);
+  if (maxSize < moveNum) {
     maxSize += 1;
+  } else if (maxSize < moveNum * MAX_LIST_BATCHES) {
+    maxSize += moveNum;
   }
 
+  CountPath(PATH_REFILL);
+  CONCUR_PROBE(refill, SizeMap::Index(objSize), batchNum);
+
+  // 超过硬上限的处理函数可能释放内存，先结束操作，取走缓存的线程也无需等待加锁与分配
+  EndOp();
   void* start = nullptr;
   void* end = nullptr;
-  size_t actualNum = CentralCache::Instance().RemoveRange(start, end, batchNum, objSize);
-  list.PushRange(start, end, actualNum);
+  size_t actualNum = CentralCache::Instance().RemoveRange(start, end, batchNum, objSize, _shard);
 
-  return list.Pop();
+  // 期间缓存可能已被取走，对象仍放入自由链表；链表被取空说明低水位为0
+  BeginOwnOp();
+  list.PushRange(start, end, actualNum);
+  list.LowWater() = 0;
+  void* obj = list.Pop();
+  EndOp();
+  return obj;
 }
 
-// 释放批量对应大小的对象到CentralCache
-void ThreadCache::ReleaseToCentralCache(FreeList& list, size_t objSize) {
-  assert(objSize <= MAX_BYTES);
+// 预先从CentralCache取count个bytes字节的对象，最多取满MAX_LIST_BATCHES批
+void ThreadCache::Prewarm(size_t bytes, size_t count) {
+  assert(bytes <= MAX_BYTES);
+  size_t objSize = SizeMap::RoundUp(bytes);
+  size_t moveNum = SizeMap::ObjectMoveNum(objSize);
+  FreeList& list = _freeLists[SizeMap::Index(bytes)];
+  count = std::min(count, moveNum * MAX_LIST_BATCHES);
 
+  // 上限按批向上取整，之后的申请直接按整批从CentralCache获取
+  BeginOwnOp();
   size_t& maxSize = list.MaxSize();
-  // size_t batchNum = std::min(SizeMap::ObjectMoveNum(objSize), maxSize);
-  // if (batchNum == maxSize) {
-  //   ++maxSize;
-  // }
+  maxSize = std::max(maxSize, (count + moveNum - 1) / moveNum * moveNum);
+  size_t missing = count > list.Size() ? count - list.Size() : 0;
+  EndOp();
+
+  // 向CentralCache取对象时不在操作中，同FetchFromCentralCache
+  while (missing > 0) {
+    void* start = nullptr;
+    void* end = nullptr;
+    size_t batchNum = std::min(moveNum, missing);
+    size_t actualNum = CentralCache::Instance().RemoveRange(start, end, batchNum, objSize, _shard);
+    BeginOwnOp();
+    list.PushRange(start, end, actualNum);
+    EndOp();
+    missing -= std::min(missing, actualNum);
+  }
+}
+
+// 释放n个对应大小的对象到CentralCache
+void ThreadCache::ReleaseToCentralCache(FreeList& list, size_t objSize, size_t n) {
+  assert(objSize <= MAX_BYTES);
+  assert(n > 0 && n <= list.Size());
 
   void* start = nullptr;
   void* end = nullptr;
-  list.PopRange(start, end, maxSize);
+  list.PopRange(start, end, n);
 
+  if (_asyncFree) {
+    if (_asyncQueue->Push(start, end, objSize)) {
+      return;
+    }
+    // 队列满，回收线程跟不上时由本线程同步释放，自然限制了入队速度
+    _asyncQueue->CountFallback();
+  }
   CentralCache::Instance().InsertRange(start, end, objSize);
-}
\ No newline at end of file
+}
+
+void ThreadCache::SetAsyncFree(bool enable) {
+  if (enable && _asyncQueue == nullptr) {
+    _asyncQueue = AsyncReclaimer::Instance().Register();
+  }
+  _asyncFree = enable;
+}
+
+void ThreadCache::FreeLarge(void* ptr) {
+  if (_asyncFree) {
+    if (_asyncQueue->Push(ptr, ptr, 0)) {
+      return;
+    }
+    _asyncQueue->CountFallback();
+  }
+  AsyncReclaimer::Release({ptr, ptr, 0});
+}
+
+size_t ThreadCache::AsyncFallbacks() const {
+  return _asyncQueue != nullptr ? _asyncQueue->Fallbacks() : 0;
+}
+
+// 纪元e中退休的对象，只可能被e-1或e中进入临界区的线程读到；全局纪元推进到e+2时，
+// 这些线程都已退出临界区。同一链表中的对象退休于同一纪元，模EPOCH_LIMBO_NUM相同的旧链表必已安全
+void ThreadCache::Retire(void* ptr) {
+  assert(ptr);
+  size_t epoch = _globalEpoch.load(std::memory_order_acquire);
+  size_t i = epoch % EPOCH_LIMBO_NUM;
+  if (_limboEpoch[i] != epoch) {
+    ReleaseLimbo(i);
+    _limboEpoch[i] = epoch;
+  }
+  FreeList::Next(ptr) = _limbo[i];
+  _limbo[i] = ptr;
+  ++_limboSize[i];
+
+  if (CONCUR_UNLIKELY(++_retireCount >= EPOCH_RETIRE_INTERVAL)) {
+    ReclaimRetired();
+  }
+}
+
+size_t ThreadCache::ReclaimRetired() {
+  _retireCount = 0;
+  TryAdvanceEpoch();
+  size_t epoch = _globalEpoch.load(std::memory_order_acquire);
+
+  // 已退出线程留下的待回收对象，由之后回收的线程放回自己的缓存
+  void* orphans[EPOCH_LIMBO_NUM] = {};
+  {
+    std::lock_guard<std::mutex> lock(_cachesMutex);
+    for (size_t i = 0; i < EPOCH_LIMBO_NUM; ++i) {
+      if (_orphanLimbo[i] != nullptr && _orphanLimboEpoch[i] + 2 <= epoch) {
+        orphans[i] = _orphanLimbo[i];
+        _orphanLimbo[i] = nullptr;
+      }
+    }
+  }
+  for (void* ptr : orphans) {
+    ReleaseRetired(ptr);
+  }
+
+  size_t pending = 0;
+  for (size_t i = 0; i < EPOCH_LIMBO_NUM; ++i) {
+    if (_limboEpoch[i] + 2 <= epoch) {
+      ReleaseLimbo(i);
+    }
+    pending += _limboSize[i];
+  }
+  return pending;
+}
+
+// 小对象放回本线程的自由链表，大块内存按ConcurFree的路径释放
+void ThreadCache::ReleaseLimbo(size_t i) {
+  void* ptr = _limbo[i];
+  _limbo[i] = nullptr;
+  _limboSize[i] = 0;
+  ReleaseRetired(ptr);
+}
+
+void ThreadCache::ReleaseRetired(void* ptr) {
+  while (ptr != nullptr) {
+    void* next = FreeList::Next(ptr);
+    size_t sizeClass = PageHeap::Instance().ObjectToSizeClass(ptr);
+    if (sizeClass != 0) {
+      BeginOwnOp();
+      DeallocateIndex(ptr, sizeClass - 1);
+    } else {
+      FreeLarge(ptr);
+    }
+    ptr = next;
+  }
+}
+
+// 已退出线程的缓存不在临界区，不会阻止推进
+bool ThreadCache::TryAdvanceEpoch() {
+  size_t epoch = _globalEpoch.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  {
+    std::lock_guard<std::mutex> lock(_cachesMutex);
+    for (ThreadCache* cache = _caches; cache != nullptr; cache = cache->_nextCache) {
+      size_t local = cache->_epoch.load(std::memory_order_acquire);
+      if ((local & 1) && (local >> 1) != epoch) {
+        return false;
+      }
+    }
+  }
+  return _globalEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+}
+
+// 自由链表超过上限时只归还一批对象，保留其余对象应对下一次申请，避免在上限附近反复与CentralCache交换
+void ThreadCache::ListTooLong(FreeList& list, size_t objSize) {
+  size_t moveNum = SizeMap::ObjectMoveNum(objSize);
+  ReleaseToCentralCache(list, objSize, std::min(list.Size(), moveNum));
+
+  // 慢启动阶段之后，频繁超长说明上限偏大，缩小一批
+  size_t& maxSize = list.MaxSize();
+  if (maxSize > moveNum && ++list.Overages() > MAX_OVERAGES) {
+    maxSize -= moveNum;
+    list.Overages() = 0;
+  }
+}
+
+// 按低水位归还各自由链表中上个周期未被使用的对象，并缩小闲置链表的上限。
+// 取出单个对象时不更新低水位，只在补充时归零、批量归还时更新，两次回收之间链表未被取空时
+// 按上次回收时的长度与当前长度的较小值估计，可能偏高，每次只归还一半。
+// 之后顺带取走闲置过久的其他线程缓存，并归还闲置过久的大块空闲Span
+void ThreadCache::Scavenge() {
+  _deallocCount = 0;
+  uint32_t now = NowMs();
+  if ((uint32_t)(now - _scavengeMs) < SCAVENGE_MS) {
+    return;
+  }
+  _scavengeMs = now;
+
+  for (size_t i = 0; i < CLASS_NUM; ++i) {
+    FreeList& list = _freeLists[i];
+    size_t lowWater = std::min(list.LowWater(), list.Size());
+    if (lowWater > 0) {
+      // 每次只归还低水位的一半，持续闲置的链表逐周期减半直至清空
+      size_t drop = (lowWater + 1) / 2;
+      ReleaseToCentralCache(list, SizeMap::ClassSize(i), drop);
+      list.MaxSize() = std::max(list.MaxSize() - std::min(list.MaxSize(), drop), (size_t)1);
+    }
+    list.LowWater() = list.Size();
+  }
+
+  ReclaimCaches(true, false);
+  PageHeap::Instance().ScavengeIdle();
+}
+
+// 将全部缓存对象归还CentralCache，链表回到慢启动状态
+void ThreadCache::Flush() {
+  _flushRequested.store(true, std::memory_order_relaxed);
+  OnFlushRequested();
+}
+
+size_t ThreadCache::CachedObjects(size_t bytes) {
+  assert(bytes <= MAX_BYTES);
+  return _freeLists[SizeMap::Index(bytes)].Size();
+}
+
+void ThreadCache::BeginOwnOp() {
+  while (true) {
+    BeginOp();
+    if (CONCUR_LIKELY(pThreadCache.load(std::memory_order_relaxed) == this)) {
+      return;
+    }
+    EndOp();
+    OnFlushRequested();
+  }
+}
+
+// 加锁等待正在取走本缓存的线程完成，之后自由链表可能已被清空。先恢复pThreadCache再检查请求：
+// 其他线程先设置请求再置空pThreadCache，这里没有看到请求时，置空一定发生在恢复之后
+void ThreadCache::OnFlushRequested() {
+  std::lock_guard<std::mutex> lock(_reclaimMutex);
+  pThreadCache.store(this, std::memory_order_seq_cst);
+  if (_flushRequested.exchange(false, std::memory_order_seq_cst)) {
+    FlushLists(true);
+  }
+}
+
+void ThreadCache::FlushLists(bool own) {
+  for (size_t i = 0; i < CLASS_NUM; ++i) {
+    FreeList& list = _freeLists[i];
+    if (!list.Empty()) {
+      if (own) {
+        ReleaseToCentralCache(list, SizeMap::ClassSize(i), list.Size());
+      } else {
+        // 异步释放队列只允许所属线程入队
+        void* start = nullptr;
+        void* end = nullptr;
+        list.PopRange(start, end, list.Size());
+        CentralCache::Instance().InsertRange(start, end, SizeMap::ClassSize(i));
+      }
+    }
+    list.MaxSize() = 1;
+    list.LowWater() = 0;
+    list.Overages() = 0;
+  }
+}
+
+void ThreadCache::RequestFlush() {
+  _flushRequested.store(true, std::memory_order_seq_cst);
+  _cacheSlot->store(nullptr, std::memory_order_seq_cst);
+}
+
+// 请求所有线程在下一次申请或释放时清空各自的缓存
+void ThreadCache::RequestFlushAll() {
+  std::lock_guard<std::mutex> lock(_cachesMutex);
+  for (ThreadCache* cache = _caches; cache != nullptr; cache = cache->_nextCache) {
+    cache->RequestFlush();
+  }
+}
+
+void ThreadCache::FlushAll() { ReclaimCaches(false, true); }
+
+// CentralCache与PageHeap的慢路径计入当前线程，大块内存等路径可能在创建线程缓存前发生
+void ThreadCache::CountCurrentPath(AllocPath path, size_t n) {
+  ThreadCache* cache = pThreadCache.load(std::memory_order_relaxed);
+  if (cache != nullptr) {
+    cache->CountPath(path, n);
+  } else {
+    _orphanPathCounts[path].fetch_add(n, std::memory_order_relaxed);
+  }
+}
+
+// 已退出线程的计数在链表锁下并入全局计数，同样在锁下读取，不会漏算或重复计算
+PathStats ThreadCache::CollectPathStats() {
+  PathStats stats;
+  std::lock_guard<std::mutex> lock(_cachesMutex);
+  for (size_t i = 0; i < PATH_NUM; ++i) {
+    stats._counts[i] = _orphanPathCounts[i].load(std::memory_order_relaxed);
+  }
+  for (ThreadCache* cache = _caches; cache != nullptr; cache = cache->_nextCache) {
+    for (size_t i = 0; i < PATH_NUM; ++i) {
+      stats._counts[i] += cache->_pathCounts[i].load(std::memory_order_relaxed);
+    }
+  }
+  return stats;
+}
+
+void ThreadCache::SetDecay(size_t ms) { _decayMs.store(ms, std::memory_order_relaxed); }
+
+// 取走其他线程的缓存。所属线程访问自由链表时不加锁，每次操作先把tcOpSeq改为奇数再读pThreadCache，
+// 两者之间没有处理器屏障，由这里的ProcessBarrier补上：先读操作计数、设置请求并置空pThreadCache，
+// 屏障之后操作计数不变，说明所属线程此前不在操作中，之后开始的操作一定读到空指针，
+// 进入慢路径在_reclaimMutex上等待取走完成。读到奇数或屏障不可用时只保留请求，由所属线程自行清空。
+// 调用线程自己的缓存不在操作中（只有FlushAll会取到），直接清空
+void ThreadCache::ReclaimCaches(bool idleOnly, bool wait) {
+  size_t decayMs = _decayMs.load(std::memory_order_relaxed);
+  if (idleOnly && decayMs == 0) {
+    return;
+  }
+  if (wait) {
+    _cachesMutex.lock();
+  } else if (!_cachesMutex.try_lock()) {
+    return;
+  }
+
+  // 闲置以操作计数不变为准，首次看到某个值时开始计时，只会低估闲置时长。
+  // 候选缓存持有其_reclaimMutex，所属线程退出时先移出链表、再等待该锁，释放链表锁后仍可访问
+  uint32_t now = NowMs();
+  ThreadCache* own = nullptr;
+  ThreadCache* victims = nullptr;
+  for (ThreadCache* cache = _caches; cache != nullptr; cache = cache->_nextCache) {
+    if (cache->_cacheSlot == &pThreadCache) {
+      own = idleOnly ? nullptr : cache;
+      continue;
+    }
+    size_t seq = cache->_opSeq->load(std::memory_order_acquire);
+    if (idleOnly) {
+      if (seq != cache->_idleSeq) {
+        cache->_idleSeq = seq;
+        cache->_idleSince = now;
+        continue;
+      }
+      if ((uint32_t)(now - cache->_idleSince) < decayMs || seq == cache->_reclaimedSeq) {
+        continue;
+      }
+    }
+    // 所属线程正在清空时_reclaimMutex已被占用，只需保留请求
+    if ((seq & 1) == 0 && cache->_reclaimMutex.try_lock()) {
+      cache->_reclaimSeq = seq;
+      cache->_reclaimedSeq = seq;
+      cache->_reclaimNext = victims;
+      victims = cache;
+    }
+    cache->RequestFlush();
+  }
+  // 归还对象会加桶锁与页堆锁，而持有页堆锁的线程可能等待链表锁，先释放链表锁
+  _cachesMutex.unlock();
+
+  if (own != nullptr) {
+    own->Flush();
+  }
+  bool fenced = victims != nullptr && ProcessBarrier();
+  while (victims != nullptr) {
+    ThreadCache* cache = victims;
+    victims = cache->_reclaimNext;
+    if (fenced && cache->_opSeq->load(std::memory_order_acquire) == cache->_reclaimSeq) {
+      cache->FlushLists(false);
+    }
+    cache->_reclaimMutex.unlock();
+  }
+}
+
+// 同一下标的两个待回收链表纪元模EPOCH_LIMBO_NUM相同，较旧的一个必已安全，先放回本线程
+void ThreadCache::OrphanRetired() {
+  void* safe[EPOCH_LIMBO_NUM] = {};
+  {
+    std::lock_guard<std::mutex> lock(_cachesMutex);
+    for (size_t i = 0; i < EPOCH_LIMBO_NUM; ++i) {
+      if (_limbo[i] == nullptr) {
+        continue;
+      }
+      if (_orphanLimbo[i] != nullptr && _orphanLimboEpoch[i] != _limboEpoch[i]) {
+        if (_orphanLimboEpoch[i] > _limboEpoch[i]) {
+          safe[i] = _limbo[i];
+          _limbo[i] = nullptr;
+          _limboSize[i] = 0;
+          continue;
+        }
+        safe[i] = _orphanLimbo[i];
+        _orphanLimbo[i] = nullptr;
+      }
+      void* tail = _limbo[i];
+      while (FreeList::Next(tail) != nullptr) {
+        tail = FreeList::Next(tail);
+      }
+      FreeList::Next(tail) = _orphanLimbo[i];
+      _orphanLimbo[i] = _limbo[i];
+      _orphanLimboEpoch[i] = _limboEpoch[i];
+      _limbo[i] = nullptr;
+      _limboSize[i] = 0;
+    }
+  }
+  for (void* ptr : safe) {
+    ReleaseRetired(ptr);
+  }
+}
+
+// 先交出待回收对象（其中已安全的放回本缓存），再移出链表并把路径计数并入全局计数，最后清空缓存。
+// 移出链表前开始取走本缓存的线程仍持有_reclaimMutex，加锁等其完成；之后其他线程不会再访问本缓存，
+// 调用者随后可以回收其内存
+void ThreadCache::Exit() {
+  _epochDepth = 0;
+  _epoch.store(0, std::memory_order_release);
+  OrphanRetired();
+
+  {
+    std::lock_guard<std::mutex> lock(_cachesMutex);
+    ThreadCache** link = &_caches;
+    while (*link != this) {
+      link = &(*link)->_nextCache;
+    }
+    *link = _nextCache;
+    for (size_t i = 0; i < PATH_NUM; ++i) {
+      _orphanPathCounts[i].fetch_add(_pathCounts[i].load(std::memory_order_relaxed),
+                                     std::memory_order_relaxed);
+    }
+  }
+  // 之后归还对象经过的路径计入全局计数
+  pThreadCache.store(nullptr, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(_reclaimMutex);
+  _asyncFree = false;
+  FlushLists(true);
+  if (_asyncQueue != nullptr) {
+    AsyncReclaimer::Instance().Unregister(_asyncQueue);
+    _asyncQueue = nullptr;
+  }
+}
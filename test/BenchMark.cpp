@@ -1,4 +1,15 @@
+#include "CentralCache.h"
 #include "ConcurAlloc.h"
+#include "HandlePool.hpp"
+
+#include <random>
+
+#ifdef __linux__
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 // ntimes 一轮申请和释放内存的次数
 // nworks 线程数
@@ -93,8 +104,930 @@ void BenchmarkConcurAlloc(size_t ntimes, size_t nworks, size_t rounds) {
          nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
 }
 
+// 模拟vector倍增扩容：从16字节起每次容量翻倍直到maxBytes
+// ntimes 每个线程扩容序列的重复次数
+// nworks 线程数
+void BenchmarkRealloc(size_t ntimes, size_t nworks, size_t maxBytes) {
+  std::vector<std::thread> vthread(nworks);
+  std::atomic<size_t> realloc_costtime(0);
+  std::atomic<size_t> concur_costtime(0);
+
+  for (size_t k = 0; k < nworks; ++k) {
+    vthread[k] = std::thread([&]() {
+      size_t begin1 = clock();
+      for (size_t j = 0; j < ntimes; ++j) {
+        char* p = (char*)malloc(16);
+        for (size_t bytes = 32; bytes <= maxBytes; bytes <<= 1) {
+          p = (char*)realloc(p, bytes);
+          p[bytes - 1] = 1;
+        }
+        free(p);
+      }
+      size_t end1 = clock();
+
+      size_t begin2 = clock();
+      for (size_t j = 0; j < ntimes; ++j) {
+        char* p = (char*)ConcurAlloc(16);
+        for (size_t bytes = 32; bytes <= maxBytes; bytes <<= 1) {
+          p = (char*)ConcurRealloc(p, bytes);
+          p[bytes - 1] = 1;
+        }
+        ConcurFree(p);
+      }
+      size_t end2 = clock();
+
+      realloc_costtime += (end1 - begin1);
+      concur_costtime += (end2 - begin2);
+    });
+  }
+
+  for (auto& t : vthread) {
+    t.join();
+  }
+
+  char who[32];
+  snprintf(who, sizeof(who), nworks == 1 ? "单线程" : "%zu个线程并发", nworks);
+  printf("%s执行%zu次倍增扩容至%zu KB，realloc花费：%zu ms\n", who, ntimes, maxBytes >> 10,
+         realloc_costtime.load());
+
+  printf("%s执行%zu次倍增扩容至%zu KB，ConcurRealloc花费：%zu ms\n", who, ntimes, maxBytes >> 10,
+         concur_costtime.load());
+}
+
+// 申请并释放从minBytes到maxBytes每次翻4倍的清零内存
+// ntimes 每种大小申请和释放的次数
+void BenchmarkCalloc(size_t ntimes, size_t minBytes, size_t maxBytes) {
+  for (size_t bytes = minBytes; bytes <= maxBytes; bytes <<= 2) {
+    size_t begin1 = clock();
+    for (size_t i = 0; i < ntimes; ++i) {
+      char* p = (char*)calloc(1, bytes);
+      p[bytes - 1] = 1;
+      free(p);
+    }
+    size_t end1 = clock();
+
+    size_t begin2 = clock();
+    for (size_t i = 0; i < ntimes; ++i) {
+      char* p = (char*)ConcurAlloc(bytes);
+      memset(p, 0, bytes);
+      p[bytes - 1] = 1;
+      ConcurFree(p);
+    }
+    size_t end2 = clock();
+
+    size_t begin3 = clock();
+    for (size_t i = 0; i < ntimes; ++i) {
+      char* p = (char*)ConcurCalloc(1, bytes);
+      p[bytes - 1] = 1;
+      ConcurFree(p);
+    }
+    size_t end3 = clock();
+
+    printf("%8zu KB x %zu次: calloc花费：%zu ms，ConcurAlloc+memset花费：%zu ms，ConcurCalloc花费：%zu ms\n",
+           bytes >> 10, ntimes, end1 - begin1, end2 - begin2, end3 - begin3);
+  }
+}
+
+// 循环申请1MB到64MB的大块内存，逐页写入后释放，模拟I/O缓冲区复用
+// rounds 轮次
+void BenchmarkLargeAlloc(size_t rounds) {
+  auto cycle = [&](void* (*alloc)(size_t), void (*dealloc)(void*)) {
+    size_t begin = clock();
+    for (size_t j = 0; j < rounds; ++j) {
+      for (size_t bytes = 1 << 20; bytes <= (64 << 20); bytes <<= 1) {
+        char* p = (char*)alloc(bytes);
+        for (size_t i = 0; i < bytes; i += 4096) {
+          p[i] = 1;
+        }
+        dealloc(p);
+      }
+    }
+    size_t end = clock();
+    return end - begin;
+  };
+
+  size_t mallocTime = cycle(malloc, free);
+  ConcurSetLargeCacheLimit(0);
+  size_t uncachedTime = cycle(ConcurAlloc, ConcurFree);
+  ConcurSetLargeCacheLimit(LARGE_CACHE_BYTES);
+  size_t cachedTime = cycle(ConcurAlloc, ConcurFree);
+
+  printf("%zu轮次循环申请1MB~64MB: malloc花费：%zu ms，ConcurAlloc(无缓存)花费：%zu ms，"
+         "ConcurAlloc(大块缓存)花费：%zu ms\n",
+         rounds, mallocTime, uncachedTime, cachedTime);
+}
+
+// 长时间随机申请和释放(256KB, maxPages页]的大块内存，统计无法满足最大请求的空闲页
+// ntimes 随机操作次数
+// nslots 同时存活的内存块上限
+void BenchmarkFragmentation(size_t ntimes, size_t nslots, size_t maxPages) {
+  std::vector<void*> slots(nslots, nullptr);
+  size_t minBytes = MAX_BYTES + 1;
+  size_t maxBytes = maxPages << PAGE_SHIFT;
+  srand(1);
+
+  size_t begin = clock();
+  for (size_t i = 0; i < ntimes; ++i) {
+    size_t k = rand() % nslots;
+    if (slots[k] != nullptr) {
+      ConcurFree(slots[k]);
+      slots[k] = nullptr;
+    } else {
+      slots[k] = ConcurAlloc(minBytes + rand() % (maxBytes - minBytes + 1));
+    }
+  }
+  size_t end = clock();
+
+  PageHeap::Instance().Mutex().lock();
+  size_t freePages = PageHeap::Instance().FreePages();
+  size_t usablePages = PageHeap::Instance().FreePages(maxPages);
+  PageHeap::Instance().Mutex().unlock();
+
+  printf("随机申请释放%zu次(最多%zu块存活)花费：%zu ms，空闲页：%zu，不足%zu页而无法使用的空闲页：%zu\n",
+         ntimes, nslots, end - begin, freePages, maxPages, freePages - usablePages);
+
+  for (void* ptr : slots) {
+    if (ptr != nullptr) {
+      ConcurFree(ptr);
+    }
+  }
+}
+
+// 申请ntimes个bytes字节的小对象，使工作集远大于末级缓存，再按随机顺序全部释放
+// 释放时的元数据访问几乎都不命中缓存，返回平均每次释放的纳秒数
+void BenchmarkColdFree(size_t ntimes, size_t bytes) {
+  std::vector<void*> ptrs(ntimes);
+  for (size_t i = 0; i < ntimes; ++i) {
+    ptrs[i] = ConcurAlloc(bytes);
+  }
+  srand(1);
+  for (size_t i = ntimes - 1; i > 0; --i) {
+    std::swap(ptrs[i], ptrs[((size_t)rand() << 16 ^ rand()) % (i + 1)]);
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < ntimes; ++i) {
+    ConcurFree(ptrs[i]);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  printf("随机顺序释放%zu个%zuB对象(工作集%zuMB)：%.2f ns/次\n", ntimes, bytes,
+         (ntimes * bytes) >> 20,
+         std::chrono::duration<double, std::nano>(end - begin).count() / ntimes);
+}
+
+// 统计每GB堆内存的Span元数据字节数：按各哈希桶每次申请的页数切分1GB，
+// 另计页映射中每页的Span*和哈希桶下标
+void BenchmarkSpanMetadata() {
+  const size_t gbPages = (size_t)1 << (30 - PAGE_SHIFT);
+  const size_t mapBytes = gbPages * (sizeof(Span*) + sizeof(uint8_t));
+
+  size_t minSpanBytes = SIZE_MAX, maxSpanBytes = 0;
+  for (size_t i = 0; i < CLASS_NUM; ++i) {
+    size_t spans = gbPages / SizeMap::PageMoveNum(SizeMap::ClassSize(i));
+    minSpanBytes = std::min(minSpanBytes, spans * sizeof(Span));
+    maxSpanBytes = std::max(maxSpanBytes, spans * sizeof(Span));
+  }
+
+  printf("sizeof(Span)=%zuB，每GB堆的Span元数据：%zuKB~%zuKB，最坏(1页Span)：%zuKB，页映射：%zuKB\n",
+         sizeof(Span), minSpanBytes >> 10, maxSpanBytes >> 10, (gbPages * sizeof(Span)) >> 10,
+         mapBytes >> 10);
+}
+
+// nworks个线程反复申请并释放同一大小的对象，使所有线程集中竞争CentralCache同一哈希桶
+// 统计墙钟时间，启用锁竞争统计时另统计桶锁等待时间
+void BenchmarkCentralContention(size_t nworks, size_t rounds, size_t ntimes, size_t bytes) {
+  std::vector<std::thread> vthread(nworks);
+#ifdef CONCUR_LOCK_PROFILE
+  size_t waits = CentralCache::Instance().LockWaits();
+  size_t waitNs = CentralCache::Instance().LockWaitNs();
+#endif
+
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t k = 0; k < nworks; ++k) {
+    vthread[k] = std::thread([&]() {
+      std::vector<void*> v(ntimes);
+      for (size_t j = 0; j < rounds; ++j) {
+        for (size_t i = 0; i < ntimes; ++i) {
+          v[i] = ConcurAlloc(bytes);
+        }
+        for (size_t i = 0; i < ntimes; ++i) {
+          ConcurFree(v[i]);
+        }
+      }
+    });
+  }
+  for (auto& t : vthread) {
+    t.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  printf("%zu个线程%zu轮次申请释放%zu个%zuB对象(分片数%zu)：花费：%lld ms\n", nworks, rounds,
+         ntimes, bytes, CENTRAL_SHARDS,
+         (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count());
+#ifdef CONCUR_LOCK_PROFILE
+  waits = CentralCache::Instance().LockWaits() - waits;
+  waitNs = CentralCache::Instance().LockWaitNs() - waitNs;
+  printf("桶锁等待%zu次，共%.2f ms\n", waits, waitNs / 1e6);
+#endif
+}
+
+// 单线程反复申请ntimes个对象再全部释放，ntimes略大于一批时，自由链表在上限附近来回震荡
+void BenchmarkOscillation(size_t rounds, size_t ntimes, size_t bytes) {
+  std::vector<void*> v(ntimes);
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t j = 0; j < rounds; ++j) {
+    for (size_t i = 0; i < ntimes; ++i) {
+      v[i] = ConcurAlloc(bytes);
+    }
+    for (size_t i = 0; i < ntimes; ++i) {
+      ConcurFree(v[i]);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  printf("%zu轮次申请再释放%zu个%zuB对象：%.2f ns/次\n", rounds, ntimes, bytes,
+         std::chrono::duration<double, std::nano>(end - begin).count() / (rounds * ntimes * 2));
+}
+
+// 直接在CentralCache上反复取出并归还一个bytes字节的对象，该对象独占一个新Span，
+// 每次归还都使Span变为完全空闲，对比保留emptyLimit个空闲Span时的页堆加锁次数
+void BenchmarkSpanBoundary(size_t rounds, size_t bytes, size_t emptyLimit) {
+  ConcurSetEmptySpanLimit(emptyLimit);
+  CentralCache& central = CentralCache::Instance();
+
+  // 先取空已有Span中的对象，直到CentralCache向页堆申请了新Span
+  std::vector<void*> held;
+  void* start = nullptr;
+  void* end = nullptr;
+  size_t locks = central.HeapLockAcquires();
+  while (central.HeapLockAcquires() == locks) {
+    central.RemoveRange(start, end, 1, bytes);
+    held.push_back(start);
+  }
+  void* obj = held.back();
+  held.pop_back();
+
+  locks = central.HeapLockAcquires();
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; ++i) {
+    central.InsertRange(obj, obj, bytes);
+    central.RemoveRange(start, end, 1, bytes);
+    obj = start;
+  }
+  auto finish = std::chrono::steady_clock::now();
+  locks = central.HeapLockAcquires() - locks;
+
+  held.push_back(obj);
+  for (void* ptr : held) {
+    FreeList::Next(ptr) = nullptr;
+    central.InsertRange(ptr, ptr, bytes);
+  }
+  ConcurSetEmptySpanLimit(EMPTY_SPAN_LIMIT);
+
+  printf("Span边界处%zu轮次取出归还%zuB对象(保留%zu个空闲Span)：页堆加锁%zu次，%.2f ns/次\n", rounds,
+         bytes, emptyLimit, locks,
+         std::chrono::duration<double, std::nano>(finish - begin).count() / rounds);
+}
+
+// ThreadCache的补充与归还路径：从CentralCache按批取出nspans个Span的全部对象，打乱顺序后按批归还，
+// 分别统计链表Span与位图Span取出、归还每个对象的耗时
+void BenchmarkSpanBitmap(size_t rounds, size_t nspans, size_t bytes) {
+  CentralCache& central = CentralCache::Instance();
+  size_t batchNum = SizeMap::ObjectMoveNum(bytes);
+  size_t total = nspans * ((SizeMap::PageMoveNum(bytes) << PAGE_SHIFT) / bytes);
+  std::vector<std::pair<void*, void*>> batches;
+  std::vector<void*> objs;
+  std::mt19937 rng(1);
+
+  for (bool bitmap : {false, true}) {
+    ConcurSetBitmapSpans(bitmap);
+    double refillNs = 0;
+    double releaseNs = 0;
+    // 第0轮预热，把保留的另一种Span换掉
+    for (size_t r = 0; r <= rounds; ++r) {
+      batches.clear();
+      size_t taken = 0;
+      auto begin = std::chrono::steady_clock::now();
+      while (taken < total) {
+        void* start = nullptr;
+        void* end = nullptr;
+        taken += central.RemoveRange(start, end, batchNum, bytes);
+        batches.emplace_back(start, end);
+      }
+      auto mid = std::chrono::steady_clock::now();
+
+      // 线程归还的对象顺序与取出时无关，打乱后重新按批串起
+      objs.clear();
+      for (auto& batch : batches) {
+        for (void* cur = batch.first; cur != nullptr; cur = FreeList::Next(cur)) {
+          objs.push_back(cur);
+        }
+      }
+      std::shuffle(objs.begin(), objs.end(), rng);
+      batches.clear();
+      for (size_t i = 0; i < objs.size(); i += batchNum) {
+        size_t last = std::min(i + batchNum, objs.size()) - 1;
+        for (size_t k = i; k < last; ++k) {
+          FreeList::Next(objs[k]) = objs[k + 1];
+        }
+        FreeList::Next(objs[last]) = nullptr;
+        batches.emplace_back(objs[i], objs[last]);
+      }
+
+      auto mid2 = std::chrono::steady_clock::now();
+      for (auto& batch : batches) {
+        central.InsertRange(batch.first, batch.second, bytes);
+      }
+      auto finish = std::chrono::steady_clock::now();
+      if (r > 0) {
+        refillNs += std::chrono::duration<double, std::nano>(mid - begin).count();
+        releaseNs += std::chrono::duration<double, std::nano>(finish - mid2).count();
+      }
+    }
+    printf("%s Span %zu轮次按批取出并打乱归还%zu个%zuB对象：取出%.2f ns/个，归还%.2f ns/个\n",
+           bitmap ? "位图" : "链表", rounds, total, bytes, refillNs / rounds / total,
+           releaseNs / rounds / total);
+  }
+  ConcurSetBitmapSpans(true);
+}
+
+// 主线程为nworks个线程依次申请bytes字节的计数器，各线程分别累加ntimes次
+// 对比普通申请与独占缓存行的申请，并统计与其他线程的计数器落在同一缓存行的计数器个数
+void BenchmarkFalseSharing(size_t nworks, size_t ntimes, size_t bytes) {
+  for (int isolated = 0; isolated < 2; ++isolated) {
+    std::vector<volatile size_t*> counters(nworks);
+    for (size_t k = 0; k < nworks; ++k) {
+      counters[k] = (size_t*)(isolated ? ConcurAllocIsolated(bytes) : ConcurAlloc(bytes));
+      *counters[k] = 0;
+    }
+
+    std::vector<std::thread> vthread(nworks);
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t k = 0; k < nworks; ++k) {
+      vthread[k] = std::thread([&, k]() {
+        for (size_t i = 0; i < ntimes; ++i) {
+          *counters[k] = *counters[k] + 1;
+        }
+      });
+    }
+    for (auto& t : vthread) {
+      t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    size_t shared = 0;
+    for (size_t i = 0; i < nworks; ++i) {
+      for (size_t j = 0; j < nworks; ++j) {
+        if (i != j && (uintptr_t)counters[i] / CACHE_LINE_SIZE ==
+                          (uintptr_t)counters[j] / CACHE_LINE_SIZE) {
+          ++shared;
+          break;
+        }
+      }
+    }
+    for (auto counter : counters) {
+      ConcurFree((void*)counter);
+    }
+
+    printf("%zu个线程各累加%zuB计数器%zu次(%s)：花费：%lld ms，共享缓存行的计数器%zu个\n", nworks, bytes,
+           ntimes, isolated ? "ConcurAllocIsolated" : "ConcurAlloc",
+           (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count(),
+           shared);
+  }
+}
+
+#ifdef __linux__
+// 在fork出的子进程中从冷启动状态开始，每个请求申请并写入profile中各大小的对象后全部释放
+// 对比直接处理请求与先ConcurReserve+ConcurPrewarm再处理请求时，前几个请求的延迟与达到稳态所需的请求数
+void BenchmarkPrewarm(size_t requests, size_t reserveBytes) {
+  const PrewarmEntry profile[] = {{16, 256},   {64, 256},   {256, 256},
+                                  {1024, 256}, {4096, 256}, {16384, 256}};
+  const size_t n = sizeof(profile) / sizeof(profile[0]);
+
+  for (int prewarm = 0; prewarm < 2; ++prewarm) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+      waitpid(pid, nullptr, 0);
+      continue;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    if (prewarm) {
+      ConcurReserve(reserveBytes);
+      ConcurPrewarm(profile, n);
+    }
+    double prewarmUs =
+        std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+
+    std::vector<double> latency(requests);
+    std::vector<void*> v;
+    for (size_t r = 0; r < requests; ++r) {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < profile[i]._count; ++j) {
+          char* ptr = (char*)ConcurAlloc(profile[i]._bytes);
+          ptr[0] = 1;
+          v.push_back(ptr);
+        }
+      }
+      for (void* ptr : v) {
+        ConcurFree(ptr);
+      }
+      v.clear();
+      latency[r] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+                       .count();
+    }
+
+    // 稳态取后一半请求的中位数，达到稳态指首次不超过稳态的1.5倍，额外耗时为此前超出稳态的部分之和
+    std::vector<double> tail(latency.begin() + requests / 2, latency.end());
+    std::sort(tail.begin(), tail.end());
+    double steady = tail[tail.size() / 2];
+    size_t reach = 0;
+    double excess = 0;
+    while (reach < requests && latency[reach] > steady * 1.5) {
+      excess += latency[reach] - steady;
+      ++reach;
+    }
+    printf("%s：首个请求%.1f us，稳态%.1f us/请求，第%zu个请求达到稳态，此前额外耗时%.1f us\n",
+           prewarm ? "预留并预热后" : "冷启动", latency[0], steady, reach + 1, excess);
+    if (prewarm) {
+      printf("预留%zuMB并预热本身花费%.0f us\n", reserveBytes >> 20, prewarmUs);
+    }
+    fflush(stdout);
+    _exit(0);
+  }
+}
+#endif
+
+// 对内存池与malloc各半的指针判断归属，统计每次ConcurOwns的耗时
+void BenchmarkOwns(size_t ntimes) {
+  std::vector<void*> v(ntimes);
+  for (size_t i = 0; i < ntimes; ++i) {
+    v[i] = i % 2 ? ConcurAlloc(i % 4096 + 1) : malloc(i % 4096 + 1);
+  }
+  std::shuffle(v.begin(), v.end(), std::mt19937(1));
+
+  size_t owned = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (void* ptr : v) {
+    owned += ConcurOwns(ptr);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  for (void* ptr : v) {
+    if (ConcurOwns(ptr)) {
+      ConcurFree(ptr);
+    } else {
+      free(ptr);
+    }
+  }
+#ifdef CONCUR_ARENA_BITS
+  const char* mode = "预留地址，范围比较";
+#else
+  const char* mode = "基数树页映射";
+#endif
+  printf("%zu个混合指针判断归属(%s)：属于内存池%zu个，%.2f ns/次\n", ntimes, mode, owned,
+         std::chrono::duration<double, std::nano>(end - begin).count() / ntimes);
+}
+
+// 指针结点与32位句柄结点的二叉搜索树
+struct PtrTreeNode {
+  PtrTreeNode* _left = nullptr;
+  PtrTreeNode* _right = nullptr;
+  uint32_t _key = 0;
+};
+struct HandleTreeNode {
+  uint32_t _left = 0;
+  uint32_t _right = 0;
+  uint32_t _key = 0;
+};
+
+// 以相同的随机键分别建立指针结点（ObjectPool）与句柄结点（HandlePool）的二叉搜索树，比较随机查找耗时
+void BenchmarkHandlePool(size_t nnodes, size_t nlookups) {
+  std::mt19937 rng(1);
+  std::vector<uint32_t> keys(nnodes);
+  for (uint32_t& key : keys) {
+    key = (uint32_t)rng();
+  }
+
+  ObjectPool<PtrTreeNode> ptrPool;
+  PtrTreeNode* ptrRoot = nullptr;
+  HandlePool<HandleTreeNode> handlePool(nnodes + 1);
+  uint32_t handleRoot = 0;
+  for (uint32_t key : keys) {
+    PtrTreeNode** link = &ptrRoot;
+    while (*link != nullptr) {
+      link = key < (*link)->_key ? &(*link)->_left : &(*link)->_right;
+    }
+    *link = ptrPool.New();
+    (*link)->_key = key;
+
+    uint32_t* handleLink = &handleRoot;
+    while (*handleLink != 0) {
+      HandleTreeNode* node = handlePool.Resolve(*handleLink);
+      handleLink = key < node->_key ? &node->_left : &node->_right;
+    }
+    uint32_t handle = handlePool.New();
+    handlePool.Resolve(handle)->_key = key;
+    *handleLink = handle;
+  }
+
+  std::vector<uint32_t> lookups(nlookups);
+  for (uint32_t& key : lookups) {
+    key = keys[rng() % nnodes];
+  }
+
+  size_t found = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (uint32_t key : lookups) {
+    PtrTreeNode* cur = ptrRoot;
+    while (cur != nullptr) {
+      if (cur->_key == key) {
+        break;
+      }
+      cur = key < cur->_key ? cur->_left : cur->_right;
+    }
+    found += cur != nullptr;
+  }
+  auto mid = std::chrono::steady_clock::now();
+  for (uint32_t key : lookups) {
+    uint32_t cur = handleRoot;
+    while (cur != 0) {
+      HandleTreeNode* node = handlePool.Resolve(cur);
+      if (node->_key == key) {
+        break;
+      }
+      cur = key < node->_key ? node->_left : node->_right;
+    }
+    found -= cur != 0;
+  }
+  auto end = std::chrono::steady_clock::now();
+  assert(found == 0);
+
+  printf("%zu个结点的二叉搜索树随机查找%zu次：指针结点%zuB %.2f ns/次，句柄结点%zuB %.2f ns/次\n",
+         nnodes, nlookups, sizeof(PtrTreeNode),
+         std::chrono::duration<double, std::nano>(mid - begin).count() / nlookups,
+         sizeof(HandleTreeNode),
+         std::chrono::duration<double, std::nano>(end - mid).count() / nlookups);
+}
+
+// 模拟网络I/O线程：保持一批大小不一的缓冲区（偶有大块），每次申请一个新的并释放最旧的，逐次测量ConcurFree耗时；
+// 同时nworks个线程持续申请释放，与之争用桶锁与页堆锁。比较同步释放与异步释放的延迟分位数
+void BenchmarkAsyncFree(size_t ntimes, size_t nworks, bool async) {
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k < nworks; ++k) {
+    workers.emplace_back([&stop, k]() {
+      std::mt19937 rng(k + 100);
+      std::vector<void*> v(512);
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (void*& ptr : v) {
+          ptr = ConcurAlloc(rng() % 16384 + 1);
+        }
+        for (void* ptr : v) {
+          ConcurFree(ptr);
+        }
+      }
+    });
+  }
+
+  std::vector<double> ns(ntimes);
+  size_t fallbacks = 0;
+  std::thread io([&]() {
+    ConcurSetAsyncFree(async);
+    std::mt19937 rng(1);
+    const size_t window = 256;
+    std::vector<void*> buffers(window);
+    for (void*& ptr : buffers) {
+      ptr = ConcurAlloc(rng() % 32768 + 64);
+    }
+    for (size_t i = 0; i < ntimes; ++i) {
+      size_t bytes = rng() % 256 == 0 ? (2 << 20) : rng() % 32768 + 64;
+      void* ptr = buffers[i % window];
+      buffers[i % window] = ConcurAlloc(bytes);
+
+      auto begin = std::chrono::steady_clock::now();
+      ConcurFree(ptr);
+      auto end = std::chrono::steady_clock::now();
+      ns[i] = std::chrono::duration<double, std::nano>(end - begin).count();
+    }
+    for (void* ptr : buffers) {
+      ConcurFree(ptr);
+    }
+    fallbacks = ConcurAsyncFreeFallbacks();
+    ConcurSetAsyncFree(false);
+  });
+  io.join();
+  stop = true;
+  for (auto& t : workers) {
+    t.join();
+  }
+
+  std::sort(ns.begin(), ns.end());
+  printf("I/O线程释放%zu次(%s，%zu个竞争线程)：p50 %.0f ns，p99 %.0f ns，p99.9 %.0f ns，最长 %.0f ns，队列满%zu次\n",
+         ntimes, async ? "异步释放" : "同步释放", nworks, ns[ntimes / 2], ns[ntimes * 99 / 100],
+         ns[ntimes * 999 / 1000], ns[ntimes - 1], fallbacks);
+}
+
+// 无锁栈（Treiber栈）结点，弹出的结点可能仍被其他弹出者读取_next，需延迟回收；
+// 延迟回收期间结点不会被复用，比较交换也就不会遇到ABA
+struct StackNode {
+  size_t _value;
+  StackNode* _next;
+};
+
+// 对照组：在ConcurFree之上自行实现的纪元回收，每个退休对象另外申请一个链表结点
+struct BoltOnRetired {
+  void* _ptr;
+  BoltOnRetired* _next;
+};
+
+struct BoltOnLimbo {
+  BoltOnRetired* _lists[EPOCH_LIMBO_NUM] = {};
+  size_t _epochs[EPOCH_LIMBO_NUM] = {};
+  size_t _sizes[EPOCH_LIMBO_NUM] = {};
+  size_t _retireCount = 0;
+};
+
+static const size_t BOLT_ON_THREADS = 64;
+static std::atomic<size_t> boltOnEpoch{0};
+static std::atomic<size_t> boltOnSlots[BOLT_ON_THREADS];  // 各线程登记的纪元，编码同ThreadCache
+
+static void BoltOnFree(BoltOnLimbo& limbo, size_t i) {
+  for (BoltOnRetired* cur = limbo._lists[i]; cur != nullptr;) {
+    BoltOnRetired* next = cur->_next;
+    ConcurFree(cur->_ptr);
+    ConcurDelete(cur);
+    cur = next;
+  }
+  limbo._lists[i] = nullptr;
+  limbo._sizes[i] = 0;
+}
+
+static size_t BoltOnReclaim(BoltOnLimbo& limbo, size_t nworks) {
+  limbo._retireCount = 0;
+  size_t epoch = boltOnEpoch.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bool quiescent = true;
+  for (size_t k = 0; k < nworks && quiescent; ++k) {
+    size_t local = boltOnSlots[k].load(std::memory_order_acquire);
+    quiescent = !(local & 1) || (local >> 1) == epoch;
+  }
+  if (quiescent) {
+    boltOnEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+  }
+
+  epoch = boltOnEpoch.load(std::memory_order_acquire);
+  size_t pending = 0;
+  for (size_t i = 0; i < EPOCH_LIMBO_NUM; ++i) {
+    if (limbo._epochs[i] + 2 <= epoch) {
+      BoltOnFree(limbo, i);
+    }
+    pending += limbo._sizes[i];
+  }
+  return pending;
+}
+
+static void BoltOnRetire(BoltOnLimbo& limbo, void* ptr, size_t nworks) {
+  size_t epoch = boltOnEpoch.load(std::memory_order_acquire);
+  size_t i = epoch % EPOCH_LIMBO_NUM;
+  if (limbo._epochs[i] != epoch) {
+    BoltOnFree(limbo, i);
+    limbo._epochs[i] = epoch;
+  }
+  limbo._lists[i] = ConcurNew<BoltOnRetired>(BoltOnRetired{ptr, limbo._lists[i]});
+  ++limbo._sizes[i];
+  if (++limbo._retireCount >= EPOCH_RETIRE_INTERVAL) {
+    BoltOnReclaim(limbo, nworks);
+  }
+}
+
+// nworks个线程在同一个无锁栈上各压入、弹出ntimes次，弹出的结点经纪元回收释放
+// builtin为true时用ConcurRetire，否则用在ConcurFree之上外挂的纪元回收
+void BenchmarkEpochStack(size_t ntimes, size_t nworks, bool builtin) {
+  assert(nworks <= BOLT_ON_THREADS);
+  std::atomic<StackNode*> top{nullptr};
+  std::atomic<size_t> popped{0};
+  std::vector<std::thread> vthread;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t k = 0; k < nworks; ++k) {
+    vthread.emplace_back([&, k]() {
+      BoltOnLimbo limbo;
+      size_t sum = 0;
+      for (size_t i = 0; i < ntimes; ++i) {
+        StackNode* node = ConcurNew<StackNode>(StackNode{i, top.load(std::memory_order_relaxed)});
+        while (!top.compare_exchange_weak(node->_next, node, std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+        }
+
+        // 每个线程先压入再弹出，弹出时栈非空
+        if (builtin) {
+          ConcurEpochEnter();
+        } else {
+          boltOnSlots[k].store((boltOnEpoch.load(std::memory_order_relaxed) << 1) | 1,
+                               std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        node = top.load(std::memory_order_acquire);
+        while (!top.compare_exchange_weak(node, node->_next, std::memory_order_acquire,
+                                          std::memory_order_acquire)) {
+        }
+        sum += node->_value;
+        if (builtin) {
+          ConcurEpochExit();
+          ConcurRetire(node);
+        } else {
+          boltOnSlots[k].store(0, std::memory_order_release);
+          BoltOnRetire(limbo, node, nworks);
+        }
+      }
+
+      // 等其他线程退出临界区后释放剩余的退休对象
+      while ((builtin ? ConcurEpochReclaim() : BoltOnReclaim(limbo, nworks)) > 0) {
+        std::this_thread::yield();
+      }
+      popped += sum;
+    });
+  }
+  for (auto& t : vthread) {
+    t.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  assert(top.load() == nullptr);
+  assert(popped == nworks * (ntimes * (ntimes - 1) / 2));
+
+  double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+  printf("%zu个线程在无锁栈上各压入弹出%zu次(%s)：花费：%.0f ms，%.2f ns/次\n", nworks, ntimes,
+         builtin ? "ConcurRetire" : "外挂纪元+链表结点", ms, ms * 1e6 / (nworks * ntimes));
+}
+
+static size_t PageHeapFreePages() {
+  PageHeap::Instance().Mutex().lock();
+  size_t pages = PageHeap::Instance().FreePages();
+  PageHeap::Instance().Mutex().unlock();
+  return pages;
+}
+
+// 工作线程rounds轮次申请释放ntimes个bytes字节的对象后休眠，对比请求清空前后PageHeap的空闲页
+void BenchmarkThreadCacheFlush(size_t rounds, size_t ntimes, size_t bytes) {
+  std::atomic<int> step(0);
+  std::thread worker([&]() {
+    std::vector<void*> v(ntimes);
+    for (size_t j = 0; j < rounds; ++j) {
+      for (size_t i = 0; i < ntimes; ++i) {
+        v[i] = ConcurAlloc(bytes);
+      }
+      for (size_t i = 0; i < ntimes; ++i) {
+        ConcurFree(v[i]);
+      }
+    }
+    step = 1;
+    // 模拟休眠的线程池线程，醒来后只做一次申请释放
+    while (step != 2) {
+      std::this_thread::yield();
+    }
+    ConcurFree(ConcurAlloc(bytes));
+    step = 3;
+  });
+
+  while (step != 1) {
+    std::this_thread::yield();
+  }
+  size_t before = PageHeapFreePages();
+  // 工作线程仍在休眠，其缓存由本线程直接取走归还
+  ConcurThreadCacheFlushAll();
+  size_t flushed = PageHeapFreePages();
+  step = 2;
+  while (step != 3) {
+    std::this_thread::yield();
+  }
+  size_t after = PageHeapFreePages();
+  worker.join();
+
+  printf("线程%zu轮次申请释放%zu个%zuB对象后休眠：PageHeap空闲页 %zu，清空后（未唤醒）%zu，唤醒后 %zu\n",
+         rounds, ntimes, bytes, before, flushed, after);
+}
+
+#ifdef __linux__
+static void* volatile hitPathSink;
+
+// 在子进程中单步执行region，返回前后两次SIGSTOP之间的用户态指令数（含raise本身的开销）
+template <class Region>
+size_t CountInstructions(Region region) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    // 预热，使region全部命中ThreadCache
+    for (size_t i = 0; i < 1000; ++i) {
+      ConcurFree(ConcurAlloc(16));
+    }
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    raise(SIGSTOP);
+    region();
+    raise(SIGSTOP);
+    _exit(0);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  size_t count = 0;
+  while (true) {
+    ptrace(PTRACE_SINGLESTEP, pid, nullptr, nullptr);
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) || (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP)) {
+      break;
+    }
+    ++count;
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  return count;
+}
+
+// 统计ThreadCache命中时一次ConcurAlloc和ConcurFree执行的指令数
+void BenchmarkHitPathInstructions() {
+  size_t base = CountInstructions([] {});
+  size_t alloc = CountInstructions([] { hitPathSink = ConcurAlloc(16); });
+  size_t allocFree = CountInstructions([] { ConcurFree(hitPathSink = ConcurAlloc(16)); });
+  printf("命中ThreadCache时的指令数：ConcurAlloc %zu条，ConcurFree %zu条\n", alloc - base,
+         allocFree - alloc);
+
+  struct Node16 {
+    void* _ptrs[2];
+  };
+  size_t typedNew = CountInstructions([] { hitPathSink = ConcurNew<Node16>(); });
+  size_t typedNewDelete =
+      CountInstructions([] { ConcurDelete((Node16*)(hitPathSink = ConcurNew<Node16>())); });
+  printf("命中ThreadCache时的指令数：ConcurNew<T> %zu条，ConcurDelete<T> %zu条\n", typedNew - base,
+         typedNewDelete - typedNew);
+}
+#endif
+
+static const size_t LOOKUP_BATCH = 32;  // 批量预取时每批的页号数
+
+// 随机查找keys中的页号，batched时每LOOKUP_BATCH个先预取再读取，返回平均每次查找的纳秒数
+template <class Map>
+double PageMapLookupNs(const Map& map, const std::vector<uintptr_t>& keys, bool batched) {
+  uintptr_t sum = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < keys.size(); i += LOOKUP_BATCH) {
+    size_t n = std::min(LOOKUP_BATCH, keys.size() - i);
+    if (batched) {
+      for (size_t j = 0; j < n; ++j) {
+        map.Prefetch(keys[i + j]);
+      }
+    }
+    for (size_t j = 0; j < n; ++j) {
+      sum += (uintptr_t)map.get(keys[i + j]);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  assert(sum != 0);
+  (void)sum;
+  return std::chrono::duration<double, std::nano>(end - begin).count() / keys.size();
+}
+
+template <class Map>
+void BenchmarkPageMapVariant(const char* name, uintptr_t base, size_t rangeBits, size_t nkeys) {
+  Map* map = new Map(SystemAllocator::Alloc);
+  std::vector<uintptr_t> keys(nkeys);
+  srand(1);
+  for (size_t i = 0; i < nkeys; ++i) {
+    keys[i] = base + (((size_t)rand() << 16 ^ rand()) & ((1 << rangeBits) - 1));
+    map->set(keys[i], (void*)(keys[i] | 1));
+  }
+
+  double plainNs = PageMapLookupNs(*map, keys, false);
+  double batchedNs = PageMapLookupNs(*map, keys, true);
+  printf("%-14s 随机查找%zu次: 逐个查找 %.2f ns/次，批量预取 %.2f ns/次\n", name, nkeys, plainNs,
+         batchedNs);
+  // 页映射的叶子结点由SystemAllocator申请且不回收
+  delete map;
+}
+
+// 对比单层数组、两层和三层基数树的查找延迟，页号分布在2^rangeBits页（8KB/页）的范围内
+void BenchmarkPageMap(size_t rangeBits, size_t nkeys) {
+  void* ptr = ConcurAlloc(16);
+  uintptr_t base = ((uintptr_t)ptr >> PAGE_SHIFT) & ~(((uintptr_t)1 << rangeBits) - 1);
+  ConcurFree(ptr);
+
+  BenchmarkPageMapVariant<PageMap1<22>>("PageMap1<22>", 0, rangeBits, nkeys);
+  BenchmarkPageMapVariant<PageMap2<VA_BITS - PAGE_SHIFT>>("PageMap2<35>", base, rangeBits, nkeys);
+  BenchmarkPageMapVariant<PageMap3<ADDRESS_BITS - PAGE_SHIFT>>("PageMap3<51>", base, rangeBits,
+                                                               nkeys);
+}
+
+// 各层微基准测试，见MicroBench.cpp
+void RunMicroBenchmarks();
+
 int main() {
   size_t n = 10000;
+#ifdef __linux__
+  // 需要在进程的分配器状态被其他测试预热之前运行
+  cout << "==========================================================" << endl;
+  BenchmarkPrewarm(200, 16 << 20);
+#endif
   cout << "==========================================================" << endl;
   BenchmarkMalloc(n, 4, 10);
 
@@ -103,5 +1036,82 @@ int main() {
   BenchmarkConcurAlloc(n, 4, 10);
   cout << "==========================================================" << endl;
 
+  BenchmarkRealloc(100, 1, 4 << 20);
+  cout << "==========================================================" << endl;
+
+  BenchmarkCalloc(20, 1 << 10, 64 << 20);
+  cout << "==========================================================" << endl;
+
+  BenchmarkLargeAlloc(10);
+  cout << "==========================================================" << endl;
+
+  BenchmarkFragmentation(200000, 256, 256);
+  cout << "==========================================================" << endl;
+
+  BenchmarkPageMap(22, 1 << 20);
+  cout << "==========================================================" << endl;
+
+  BenchmarkOwns(1 << 20);
+  cout << "==========================================================" << endl;
+
+  BenchmarkHandlePool(1 << 16, 1 << 20);
+  BenchmarkHandlePool(1 << 20, 1 << 20);
+  cout << "==========================================================" << endl;
+
+  BenchmarkAsyncFree(200000, 2, false);
+  BenchmarkAsyncFree(200000, 2, true);
+  cout << "==========================================================" << endl;
+
+  BenchmarkEpochStack(1000000, 4, false);
+  BenchmarkEpochStack(1000000, 4, true);
+  cout << "==========================================================" << endl;
+
+  BenchmarkColdFree(2 << 20, 64);
+  cout << "==========================================================" << endl;
+
+  BenchmarkSpanMetadata();
+  cout << "==========================================================" << endl;
+
+  BenchmarkOscillation(2000, 600, 32);
+  BenchmarkOscillation(2000, 600, 1024);
+  cout << "==========================================================" << endl;
+
+  BenchmarkSpanBoundary(100000, 4096, 0);
+  BenchmarkSpanBoundary(100000, 4096, EMPTY_SPAN_LIMIT);
+  cout << "==========================================================" << endl;
+
+  BenchmarkSpanBitmap(20, 64, 64);
+  BenchmarkSpanBitmap(20, 16, 1024);
+  cout << "==========================================================" << endl;
+
+  BenchmarkFalseSharing(8, 20000000, 24);
+  cout << "==========================================================" << endl;
+
+  BenchmarkThreadCacheFlush(10, 150, 20 << 10);
+  cout << "==========================================================" << endl;
+
+  BenchmarkCentralContention(32, 20, 4096, 32);
+  cout << "==========================================================" << endl;
+
+#ifdef __linux__
+  BenchmarkHitPathInstructions();
+  cout << "==========================================================" << endl;
+#endif
+
+  RunMicroBenchmarks();
+  cout << "==========================================================" << endl;
+
+  ConcurDumpLockProfile();
+  cout << "==========================================================" << endl;
+
+  // 以上全部负载经过各路径的次数
+  const char* pathNames[PATH_NUM] = {"线程缓存命中", "补充线程缓存", "跳过满Span",   "申请Span",
+                                     "页堆切分",     "映射新内存",   "合并空闲Span", "大块申请"};
+  PathStats paths = ConcurGetPathStats();
+  for (size_t i = 0; i < PATH_NUM; ++i) {
+    printf("%s：%zu次\n", pathNames[i], paths._counts[i]);
+  }
+  cout << "==========================================================" << endl;
+
   return 0;
 }
@@ -0,0 +1,208 @@
+#include "CentralCache.h"
+#include "ConcurAlloc.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// 各层独立的微基准测试，报告ns/op以及perf_event_open读取的硬件计数器
+// 硬件计数器不可用（非Linux、容器或虚拟机未开放PMU、perf_event_paranoid过高）时只报告ns/op
+
+// 用户态硬件计数器，每个事件单独打开，任意一个打开失败只影响该列
+class PerfCounters {
+ public:
+  enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, EVENT_NUM };
+
+  PerfCounters() {
+#ifdef __linux__
+    const uint64_t configs[EVENT_NUM] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                         PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = configs[i];
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      _fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int fd : _fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+#endif
+  }
+
+  bool Available() const {
+    for (int fd : _fds) {
+      if (fd >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Start() {
+#ifdef __linux__
+    for (int fd : _fds) {
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  // 停止计数并读出各事件的值，不可用的事件为-1
+  void Stop(double values[EVENT_NUM]) {
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      values[i] = -1;
+#ifdef __linux__
+      uint64_t count = 0;
+      if (_fds[i] >= 0) {
+        ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(_fds[i], &count, sizeof(count)) == sizeof(count)) {
+          values[i] = (double)count;
+        }
+      }
+#endif
+    }
+  }
+
+ private:
+  int _fds[EVENT_NUM] = {-1, -1, -1, -1};
+};
+
+static PerfCounters& Counters() {
+  static PerfCounters counters;
+  return counters;
+}
+
+// 执行body（内部完成ops次操作），打印每次操作的耗时与计数器
+template <class Body>
+static void RunMicro(const char* name, size_t ops, Body body) {
+  double values[PerfCounters::EVENT_NUM];
+  Counters().Start();
+  auto begin = std::chrono::steady_clock::now();
+  body();
+  auto end = std::chrono::steady_clock::now();
+  Counters().Stop(values);
+
+  printf("%-32s %8.2f ns/op", name,
+         std::chrono::duration<double, std::nano>(end - begin).count() / ops);
+  const char* labels[PerfCounters::EVENT_NUM] = {"cycles", "instr", "cache-miss", "branch-miss"};
+  for (int i = 0; i < PerfCounters::EVENT_NUM; ++i) {
+    if (values[i] >= 0) {
+      printf("  %s %.2f", labels[i], values[i] / ops);
+    } else {
+      printf("  %s n/a", labels[i]);
+    }
+  }
+  printf("\n");
+}
+
+static void* volatile microSink;
+
+// FreeList压入与弹出，对象来自一块连续内存
+static void MicroFreeList(size_t n) {
+  std::vector<char> memory(n * 16);
+  FreeList list;
+  RunMicro("FreeList::Push+Pop", n, [&]() {
+    for (size_t i = 0; i < n; ++i) {
+      list.Push(&memory[i * 16]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      microSink = list.Pop();
+    }
+  });
+}
+
+// SizeMap::Index，输入为随机大小，分支难以预测
+static void MicroSizeMapIndex(size_t n) {
+  std::vector<uint32_t> sizes(n);
+  srand(1);
+  for (size_t i = 0; i < n; ++i) {
+    sizes[i] = (uint32_t)(((size_t)rand() << 16 ^ rand()) % MAX_BYTES + 1);
+  }
+  size_t sum = 0;
+  RunMicro("SizeMap::Index", n, [&]() {
+    for (size_t i = 0; i < n; ++i) {
+      sum += SizeMap::Index(sizes[i]);
+    }
+  });
+  microSink = (void*)sum;
+}
+
+// CentralCache批量移除再插回batchNum个objSize字节的对象，每次操作为一对RemoveRange+InsertRange
+static void MicroCentralCache(size_t n, size_t batchNum, size_t objSize) {
+  RunMicro("CentralCache::RemoveRange+Insert", n, [&]() {
+    for (size_t i = 0; i < n; ++i) {
+      void* start = nullptr;
+      void* end = nullptr;
+      CentralCache::Instance().RemoveRange(start, end, batchNum, objSize);
+      CentralCache::Instance().InsertRange(start, end, objSize);
+    }
+  });
+}
+
+// PageHeap连续切出nspans个pages页的Span，再按地址顺序归还，每次归还都与前一个Span合并
+static void MicroPageHeap(size_t rounds, size_t nspans, size_t pages) {
+  std::vector<Span*> spans(nspans);
+  PageHeap::Instance().Mutex().lock();
+  RunMicro("PageHeap::New+Delete+Merge", rounds * nspans, [&]() {
+    for (size_t j = 0; j < rounds; ++j) {
+      for (size_t i = 0; i < nspans; ++i) {
+        spans[i] = PageHeap::Instance().New(pages);
+      }
+      for (size_t i = 0; i < nspans; ++i) {
+        PageHeap::Instance().Delete(spans[i]);
+      }
+    }
+  });
+  PageHeap::Instance().Mutex().unlock();
+}
+
+// PageMap3::get，页号随机分布在2^rangeBits页内
+static void MicroPageMap3(size_t n, size_t rangeBits) {
+  typedef PageMap3<VA_BITS - PAGE_SHIFT> Map;
+  Map* map = new Map(SystemAllocator::Alloc);
+  std::vector<uintptr_t> keys(n);
+  srand(1);
+  for (size_t i = 0; i < n; ++i) {
+    keys[i] = ((size_t)rand() << 16 ^ rand()) & ((1 << rangeBits) - 1);
+    map->set(keys[i], (void*)(keys[i] | 1));
+  }
+
+  uintptr_t sum = 0;
+  RunMicro("PageMap3::get", n, [&]() {
+    for (size_t i = 0; i < n; ++i) {
+      sum += (uintptr_t)map->get(keys[i]);
+    }
+  });
+  microSink = (void*)sum;
+  // 页映射的叶子结点由SystemAllocator申请且不回收
+  delete map;
+}
+
+// 依次运行各层的微基准测试
+void RunMicroBenchmarks() {
+  if (!Counters().Available()) {
+    printf("硬件计数器不可用（perf_event_open失败），只报告ns/op\n");
+  }
+  MicroFreeList(1 << 20);
+  MicroSizeMapIndex(1 << 20);
+  MicroCentralCache(1 << 16, 32, 64);
+  MicroPageHeap(256, 64, 1);
+  MicroPageMap3(1 << 20, 22);
+}
@@ -1,5 +1,16 @@
+#include "AsyncFree.h"
+#include "CentralCache.h"
 #include "ConcurAlloc.h"
+#include "HandlePool.hpp"
 #include "ObjectPool.hpp"
+#include "SharedHeap.h"
+
+#include <set>
+
+#ifdef __linux__
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 struct TreeNode {
   int _val;
@@ -8,6 +19,11 @@ struct TreeNode {
   TreeNode() : _val(0), _left(nullptr), _right(nullptr) {}
 };
 
+// 经由内存池的operator new/delete
+struct PooledTreeNode : TreeNode {
+  CONCUR_POOLED(PooledTreeNode)
+};
+
 void TestObjectPool() {
   const size_t Rounds = 3;  // 申请轮次
   const size_t N = 100000;  // 每轮申请次数
@@ -43,8 +59,92 @@ void TestObjectPool() {
   }
   size_t end2 = clock();
 
+  std::vector<TreeNode *> v3;
+  v3.reserve(N);
+
+  size_t begin3 = clock();
+  for (size_t j = 0; j < Rounds; ++j) {
+    for (size_t i = 0; i < N; ++i) {
+      v3.push_back(ConcurNew<TreeNode>());
+    }
+    for (size_t i = 0; i < N; ++i) {
+      ConcurDelete(v3[i]);
+    }
+    v3.clear();
+  }
+  size_t end3 = clock();
+
+  std::vector<PooledTreeNode *> v4;
+  v4.reserve(N);
+
+  size_t begin4 = clock();
+  for (size_t j = 0; j < Rounds; ++j) {
+    for (size_t i = 0; i < N; ++i) {
+      v4.push_back(new PooledTreeNode);
+    }
+    for (size_t i = 0; i < N; ++i) {
+      delete v4[i];
+    }
+    v4.clear();
+  }
+  size_t end4 = clock();
+
   cout << "new cost time:" << end1 - begin1 << endl;
   cout << "object pool cost time:" << end2 - begin2 << endl;
+  cout << "ConcurNew cost time:" << end3 - begin3 << endl;
+  cout << "CONCUR_POOLED new cost time:" << end4 - begin4 << endl;
+}
+
+struct ThrowingNode {
+  char _data[40];
+  explicit ThrowingNode(bool fail) {
+    if (fail) {
+      throw std::runtime_error("ctor");
+    }
+  }
+};
+
+// 类型化申请：编译期下标与运行期一致，构造参数转发，构造失败时归还内存
+void TestConcurNew() {
+  static_assert(SizeMap::Index(sizeof(TreeNode)) == 2, "24字节对象位于第3个哈希桶");
+  static_assert(SizeMap::ClassSize(SizeMap::Index(1000)) == SizeMap::RoundUp(1000), "");
+
+  TreeNode *node = ConcurNew<TreeNode>();
+  assert(node->_val == 0 && node->_left == nullptr);
+  assert(PageHeap::Instance().ObjectToSizeClass(node) == SizeMap::Index(sizeof(TreeNode)) + 1);
+  ConcurDelete(node);
+
+  std::pair<int, double> *pair = ConcurNew<std::pair<int, double>>(1, 2.5);
+  assert(pair->first == 1 && pair->second == 2.5);
+  ConcurDelete(pair);
+
+  // 构造失败后内存已归还，同一线程再次申请得到同一块内存
+  void *ptr = ConcurAllocFixed<sizeof(ThrowingNode)>();
+  ConcurFreeFixed<sizeof(ThrowingNode)>(ptr);
+  bool thrown = false;
+  try {
+    ConcurNew<ThrowingNode>(true);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+  ThrowingNode *ok = ConcurNew<ThrowingNode>(false);
+  assert((void *)ok == ptr);
+  ConcurDelete(ok);
+
+  // 超过256KB的类型退回页堆
+  struct Huge {
+    char _data[300 << 10];
+  };
+  Huge *huge = ConcurNew<Huge>();
+  assert(PageHeap::Instance().ObjectToSizeClass(huge) == 0);
+  ConcurDelete(huge);
+
+  PooledTreeNode *pooled = new PooledTreeNode;
+  assert(PageHeap::Instance().ObjectToSizeClass(pooled) != 0);
+  delete pooled;
+  (void)thrown;
+  (void)ok;
 }
 
 void TestConcurAlloc1() {
@@ -76,8 +176,767 @@ void TestConcurAlloc2() {
   ConcurFree(p4);
 }
 
-// int main() {
-//   // TestObjectPool();
-//   TestConcurAlloc1();
-//   return 0;
-// }
\ No newline at end of file
+// 按位置生成的字节，检查搬移与原地调整后的数据
+static unsigned char PatternByte(size_t i) { return (unsigned char)(i * 131 + 7); }
+
+// 依次扩大再缩小：小对象跨档位、越过256KB进入页堆、越过PAGE_NUM页改用mremap，
+// 每一步两次大小中较小部分的数据保持不变
+void TestRealloc() {
+  const size_t largeBytes = PAGE_NUM << PAGE_SHIFT;
+  const size_t sizes[] = {8,         100,        4 << 10,        MAX_BYTES,      MAX_BYTES + 1,
+                          largeBytes - 1, largeBytes + 1, 3 * largeBytes, 2 * largeBytes, largeBytes,
+                          MAX_BYTES + 1,  MAX_BYTES,      64,             1};
+  char *ptr = (char *)ConcurRealloc(nullptr, sizes[0]);
+  for (size_t i = 0; i < sizes[0]; ++i) {
+    ptr[i] = PatternByte(i);
+  }
+  for (size_t k = 1; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+    ptr = (char *)ConcurRealloc(ptr, sizes[k]);
+    assert(ptr != nullptr);
+    size_t kept = std::min(sizes[k - 1], sizes[k]);
+    for (size_t i = 0; i < kept; ++i) {
+      assert((unsigned char)ptr[i] == PatternByte(i));
+    }
+    for (size_t i = kept; i < sizes[k]; ++i) {
+      ptr[i] = PatternByte(i);
+    }
+  }
+  assert(ConcurRealloc(ptr, 0) == nullptr);
+}
+
+// 复用写脏的内存后仍全部清零，覆盖小对象与大块内存；大小为0返回可释放的指针，乘积溢出抛出std::bad_alloc
+void TestCalloc() {
+  const size_t sizes[] = {1, 24, 1000, 64 << 10, MAX_BYTES, MAX_BYTES + 1,
+                          (PAGE_NUM << PAGE_SHIFT) + (1 << PAGE_SHIFT)};
+  for (size_t bytes : sizes) {
+    for (size_t round = 0; round < 3; ++round) {
+      void *dirty = ConcurAlloc(bytes);
+      memset(dirty, 0xAB, bytes);
+      ConcurFree(dirty);
+
+      unsigned char *ptr = (unsigned char *)(round % 2 ? ConcurCalloc(bytes, 1) : ConcurCalloc(1, bytes));
+      for (size_t i = 0; i < bytes; ++i) {
+        assert(ptr[i] == 0);
+      }
+      ConcurFree(ptr);
+    }
+  }
+
+  void *zero1 = ConcurCalloc(0, 8);
+  void *zero2 = ConcurCalloc(8, 0);
+  assert(zero1 != nullptr && zero2 != nullptr);
+  ConcurFree(zero1);
+  ConcurFree(zero2);
+
+  bool thrown = false;
+  try {
+    ConcurCalloc(SIZE_MAX / 2, 3);
+  } catch (const std::bad_alloc &) {
+    thrown = true;
+  }
+  assert(thrown);
+  (void)thrown;
+}
+
+static size_t HeapFreePages() {
+  PageHeap::Instance().Mutex().lock();
+  size_t pages = PageHeap::Instance().FreePages();
+  PageHeap::Instance().Mutex().unlock();
+  return pages;
+}
+
+// 休眠线程缓存的对象可由其他线程归还：清空所有缓存、闲置超时与线程退出后，
+// 其缓存的约3MB对象都回到PageHeap
+void TestThreadCacheReclaim() {
+  const size_t n = 150;
+  const size_t bytes = 20 << 10;
+  const size_t minPages = n * bytes / 2 >> PAGE_SHIFT;
+  std::atomic<size_t> state{0};
+  std::thread sleeper([&state, n, bytes]() {
+    std::vector<void *> v;
+    for (size_t round = 0; round < 3; ++round) {
+      for (size_t i = 0; i < n; ++i) {
+        v.push_back(ConcurAlloc(bytes));
+      }
+      for (void *ptr : v) {
+        ConcurFree(ptr);
+      }
+      v.clear();
+      state = round * 2 + 1;
+      while (state != round * 2 + 2) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  // 清空所有缓存，休眠线程不必醒来
+  while (state != 1) {
+    std::this_thread::yield();
+  }
+  size_t before = HeapFreePages();
+  ConcurThreadCacheFlushAll();
+  size_t flushed = HeapFreePages() - before;
+  assert(flushed >= minPages);
+  state = 2;
+
+  // 闲置超时：本线程的释放触发回收，两次检查间休眠线程没有任何申请释放
+  while (state != 3) {
+    std::this_thread::yield();
+  }
+  ConcurSetThreadCacheDecay(1);
+  before = HeapFreePages();
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (HeapFreePages() < before + minPages && std::chrono::steady_clock::now() < deadline) {
+    for (size_t i = 0; i < SCAVENGE_INTERVAL; ++i) {
+      ConcurFree(ConcurAlloc(16));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  size_t decayed = HeapFreePages() - before;
+  assert(decayed >= minPages);
+  ConcurSetThreadCacheDecay(THREAD_CACHE_DECAY_MS);
+  state = 4;
+
+  // 线程退出
+  while (state != 5) {
+    std::this_thread::yield();
+  }
+  PathStats paths = ConcurGetPathStats();
+  before = HeapFreePages();
+  state = 6;
+  sleeper.join();
+  size_t exited = HeapFreePages() - before;
+  assert(exited >= minPages);
+  assert(ConcurGetPathStats()._counts[PATH_HIT] >= paths._counts[PATH_HIT]);
+
+  cout << "thread cache reclaim: flush all +" << flushed << " pages, decay +" << decayed
+       << " pages, exit +" << exited << " pages" << endl;
+  (void)minPages;
+}
+
+// 线程反复创建退出的同时其他线程不断清空所有线程缓存：正在被取走的缓存不会在所属线程退出时提前回收
+void TestThreadExitRace() {
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> flushers;
+  for (size_t i = 0; i < 2; ++i) {
+    flushers.emplace_back([&stop]() {
+      while (!stop) {
+        ConcurThreadCacheFlushAll();
+      }
+    });
+  }
+
+  for (size_t round = 0; round < 100; ++round) {
+    std::vector<std::thread> workers;
+    for (size_t k = 0; k < 4; ++k) {
+      workers.emplace_back([k]() {
+        std::vector<void *> v;
+        for (size_t i = 0; i < 256; ++i) {
+          v.push_back(ConcurAlloc((i % 64 + 1) * (k + 1) * 8));
+        }
+        for (void *ptr : v) {
+          ConcurFree(ptr);
+        }
+      });
+    }
+    for (auto &t : workers) {
+      t.join();
+    }
+  }
+  stop = true;
+  for (auto &t : flushers) {
+    t.join();
+  }
+}
+
+// 当前线程缓存的bytes字节对象数
+static size_t CachedObjects(size_t bytes) {
+  ThreadCache *cache = pThreadCache.load(std::memory_order_relaxed);
+  return cache != nullptr ? cache->CachedObjects(bytes) : 0;
+}
+
+// 按低水位回收：缓存中闲置的对象在第二个回收周期后减半，持续闲置则逐周期减少直至清空
+void TestThreadCacheScavenge() {
+  std::thread t([]() {
+    const size_t bytes = 512;
+    std::vector<void *> v;
+    for (size_t round = 0; round < 8; ++round) {
+      for (size_t i = 0; i < 256; ++i) {
+        v.push_back(ConcurAlloc(bytes));
+      }
+      for (void *ptr : v) {
+        ConcurFree(ptr);
+      }
+      v.clear();
+    }
+
+    // 只申请释放另一大小的对象，推动回收检查
+    auto tick = []() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(SCAVENGE_MS + 10));
+      for (size_t i = 0; i < SCAVENGE_INTERVAL; ++i) {
+        ConcurFree(ConcurAlloc(16));
+      }
+    };
+    size_t cached = CachedObjects(bytes);
+    assert(cached > 0);
+    tick();
+    tick();
+    size_t halved = CachedObjects(bytes);
+    assert(halved <= cached - (cached + 1) / 2);
+    for (size_t i = 0; i < 16 && CachedObjects(bytes) > 0; ++i) {
+      tick();
+    }
+    assert(CachedObjects(bytes) == 0);
+    cout << "thread cache scavenge: " << cached << " -> " << halved << " -> 0 objects" << endl;
+    (void)halved;
+  });
+  t.join();
+}
+
+// CentralCache每个分片保留的空闲Span：在Span边界处反复取出归还一个对象时，保留一个空闲Span
+// 不再加页堆锁，上限为0时每次都归还页堆；设为0时已保留的Span归还页堆
+void TestEmptySpanLimit() {
+  CentralCache &central = CentralCache::Instance();
+  const size_t bytes = 4096;
+  const size_t rounds = 100;
+  void *start = nullptr;
+  void *end = nullptr;
+  size_t boundaryLocks[2] = {};
+
+  for (size_t limit = 0; limit < 2; ++limit) {
+    ConcurSetEmptySpanLimit(limit);
+    // 取到需要新Span为止，最后一个对象独占这个Span
+    std::vector<void *> held;
+    size_t locks = central.HeapLockAcquires();
+    while (central.HeapLockAcquires() == locks) {
+      central.RemoveRange(start, end, 1, bytes);
+      held.push_back(start);
+    }
+    void *obj = held.back();
+    held.pop_back();
+
+    locks = central.HeapLockAcquires();
+    for (size_t i = 0; i < rounds; ++i) {
+      central.InsertRange(obj, obj, bytes);
+      central.RemoveRange(start, end, 1, bytes);
+      obj = start;
+    }
+    boundaryLocks[limit] = central.HeapLockAcquires() - locks;
+
+    held.push_back(obj);
+    for (void *ptr : held) {
+      FreeList::Next(ptr) = nullptr;
+      central.InsertRange(ptr, ptr, bytes);
+    }
+  }
+  assert(boundaryLocks[1] == 0);
+  assert(boundaryLocks[0] >= rounds);
+
+  size_t before = HeapFreePages();
+  ConcurSetEmptySpanLimit(0);
+  assert(HeapFreePages() >= before + SizeMap::PageMoveNum(bytes));
+  ConcurSetEmptySpanLimit(EMPTY_SPAN_LIMIT);
+}
+
+// 切分Span时末尾不足一个对象的剩余内存不切出：取出的对象都完整落在所属Span内
+void TestSpanTail() {
+  CentralCache &central = CentralCache::Instance();
+  for (size_t bytes : {24, 48, 1152}) {
+    std::vector<std::pair<void *, void *>> batches;
+    for (size_t i = 0; i < 8; ++i) {
+      void *start = nullptr;
+      void *end = nullptr;
+      size_t n = central.RemoveRange(start, end, 256, bytes);
+      for (void *cur = start; n-- > 0; cur = FreeList::Next(cur)) {
+        Span *span = PageHeap::Instance().ObjectToSpan(cur);
+        uintptr_t spanEnd = (span->_start + span->_size) << PAGE_SHIFT;
+        assert((uintptr_t)cur + bytes <= spanEnd);
+        (void)spanEnd;
+      }
+      batches.emplace_back(start, end);
+    }
+    for (auto &batch : batches) {
+      central.InsertRange(batch.first, batch.second, bytes);
+    }
+  }
+}
+
+static size_t limitHandlerCalls = 0;
+static bool CountLimitHandler(size_t bytes) {
+  ++limitHandlerCalls;
+  return false;
+}
+
+// 在当前已提交内存之上设置很小的软、硬上限，混合申请小对象与大块内存直到分配失败
+void TestMemoryLimit() {
+  HeapStats before = ConcurGetHeapStats();
+  const size_t softBytes = before._committedBytes + (16 << 20);
+  const size_t hardBytes = before._committedBytes + (32 << 20);
+  ConcurSetMemoryLimit(softBytes, hardBytes);
+  ConcurSetLimitHandler(CountLimitHandler);
+
+  std::vector<void *> v;
+  bool failed = false;
+  try {
+    for (size_t i = 0; i < 100000; ++i) {
+      v.push_back(ConcurAlloc(i % 2 ? (i % 4096) + 1 : (i % 7 + 1) << 18));
+    }
+  } catch (const std::bad_alloc &) {
+    failed = true;
+  }
+
+  HeapStats stats = ConcurGetHeapStats();
+  assert(failed);
+  assert(stats._committedBytes <= hardBytes);
+  assert(stats._softLimitHits > before._softLimitHits);
+  assert(stats._hardLimitHits > before._hardLimitHits);
+  assert(limitHandlerCalls > 0);
+
+  // 释放后在上限内可以再次分配
+  for (void *ptr : v) {
+    ConcurFree(ptr);
+  }
+  ConcurFree(ConcurAlloc(1 << 20));
+
+  cout << "limit stress: " << v.size() << " blocks, committed " << (stats._committedBytes >> 20)
+       << "MB, soft hits " << stats._softLimitHits - before._softLimitHits << ", hard hits "
+       << stats._hardLimitHits - before._hardLimitHits << ", map failures "
+       << stats._mapFailures - before._mapFailures << endl;
+
+  ConcurSetLimitHandler(nullptr);
+  ConcurSetMemoryLimit(0, 0);
+  (void)failed;
+}
+
+// 多个线程申请独占缓存行的对象，检查对齐且任意两个对象不共享缓存行
+void TestAllocIsolated() {
+  // 每个哈希桶的对象大小都是缓存行的整数倍
+  for (size_t bytes = CACHE_LINE_SIZE; bytes <= MAX_BYTES; bytes += CACHE_LINE_SIZE) {
+    assert(SizeMap::RoundUp(bytes) % CACHE_LINE_SIZE == 0);
+  }
+
+  const size_t nworks = 4, ntimes = 1000;
+  std::vector<std::vector<void *>> objs(nworks);
+  std::vector<std::thread> vthread;
+  for (size_t k = 0; k < nworks; ++k) {
+    vthread.emplace_back([&, k]() {
+      for (size_t i = 0; i < ntimes; ++i) {
+        objs[k].push_back(ConcurAllocIsolated(i % 200 + 1));
+      }
+    });
+  }
+  for (auto &t : vthread) {
+    t.join();
+  }
+
+  std::set<uintptr_t> lines;
+  size_t total = 0;
+  for (size_t k = 0; k < nworks; ++k) {
+    for (size_t i = 0; i < ntimes; ++i) {
+      uintptr_t addr = (uintptr_t)objs[k][i];
+      assert(addr % CACHE_LINE_SIZE == 0);
+      for (uintptr_t line = addr; line < addr + i % 200 + 1; line += CACHE_LINE_SIZE) {
+        lines.insert(line);
+        ++total;
+      }
+    }
+  }
+  assert(lines.size() == total);
+
+  for (auto &v : objs) {
+    for (void *ptr : v) {
+      ConcurFree(ptr);
+    }
+  }
+  cout << "isolated alloc: " << total << " cache lines, no sharing" << endl;
+}
+
+// 内存池的小对象与大块内存属于页堆，malloc与栈上的地址不属于
+// 预留地址模式下大块内存内部的地址也属于页堆
+void TestOwns() {
+  void *small = ConcurAlloc(100);
+  void *large = ConcurAlloc(2 << 20);
+  void *foreign = malloc(100);
+  int local = 0;
+  assert(ConcurOwns(small) && ConcurOwns(large));
+#ifdef CONCUR_ARENA_BITS
+  assert(ConcurOwns((char *)large + (1 << 20)));
+#endif
+  assert(!ConcurOwns(foreign) && !ConcurOwns(&local) && !ConcurOwns(nullptr));
+  ConcurFree(small);
+  ConcurFree(large);
+  free(foreign);
+  (void)local;
+}
+
+// 预留的页在大块缓存上限为0时仍保持已提交，预热后的申请直接命中线程缓存
+void TestReserve() {
+  ConcurSetLargeCacheLimit(0);
+  HeapStats before = ConcurGetHeapStats();
+  bool reserved = ConcurReserve(8 << 20);
+  assert(reserved);
+  ConcurSetLargeCacheLimit(0);
+  HeapStats after = ConcurGetHeapStats();
+  assert(after._mappedBytes >= before._mappedBytes + (8 << 20));
+  assert(after._committedBytes >= before._committedBytes + (8 << 20));
+  ConcurSetLargeCacheLimit(LARGE_CACHE_BYTES);
+
+  const PrewarmEntry profile[] = {{48, 1000}, {3000, 10}};
+  ConcurPrewarm(profile, 2);
+  size_t fetches = CentralCache::Instance().HeapLockAcquires();
+  std::vector<void *> v;
+  for (size_t i = 0; i < 10; ++i) {
+    v.push_back(ConcurAlloc(3000));
+  }
+  for (size_t i = 0; i < 1000; ++i) {
+    v.push_back(ConcurAlloc(48));
+  }
+  for (void *ptr : v) {
+    ConcurFree(ptr);
+  }
+  assert(CentralCache::Instance().HeapLockAcquires() == fetches);
+  cout << "reserve: mapped +" << ((after._mappedBytes - before._mappedBytes) >> 20) << "MB" << endl;
+  (void)reserved;
+  (void)fetches;
+}
+
+// 以句柄互相引用的字典树结点，比指针版本小一半
+struct HandleTrieNode {
+  uint32_t _children[4] = {};
+  int _value = 0;
+  explicit HandleTrieNode(int value) : _value(value) {}
+};
+
+// 多线程并发申请的句柄互不重复且能解析回各自的对象，释放后的句柄被复用而不再提交新内存
+void TestHandlePool() {
+  typedef HandlePool<HandleTrieNode> Pool;
+  static_assert(sizeof(HandleTrieNode) == 20, "句柄结点应为20字节");
+  Pool pool(1 << 20);
+  const size_t nworks = 4;
+  const size_t ntimes = 10000;
+  std::vector<std::vector<Pool::Handle>> handles(nworks);
+  std::vector<std::thread> threads;
+  for (size_t k = 0; k < nworks; ++k) {
+    threads.emplace_back([&, k]() {
+      for (size_t i = 0; i < ntimes; ++i) {
+        handles[k].push_back(pool.New((int)(k * ntimes + i)));
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  std::set<Pool::Handle> seen;
+  for (size_t k = 0; k < nworks; ++k) {
+    for (size_t i = 0; i < ntimes; ++i) {
+      Pool::Handle handle = handles[k][i];
+      assert(handle != Pool::NULL_HANDLE && seen.insert(handle).second);
+      assert(pool.Resolve(handle)->_value == (int)(k * ntimes + i));
+      (void)handle;
+    }
+  }
+
+  // 链接成一条链后沿句柄遍历
+  Pool::Handle head = Pool::NULL_HANDLE;
+  for (Pool::Handle handle : handles[0]) {
+    pool.Resolve(handle)->_children[0] = head;
+    head = handle;
+  }
+  size_t length = 0;
+  for (Pool::Handle cur = head; cur != Pool::NULL_HANDLE; cur = pool.Resolve(cur)->_children[0]) {
+    ++length;
+  }
+  assert(length == ntimes);
+
+  size_t committed = pool.CommittedBytes();
+  for (Pool::Handle handle : handles[1]) {
+    pool.Delete(handle);
+  }
+  for (size_t i = 0; i < ntimes; ++i) {
+    Pool::Handle handle = pool.New(-1);
+    assert(seen.count(handle) == 1 && pool.Resolve(handle)->_value == -1);
+    (void)handle;
+  }
+  assert(pool.CommittedBytes() == committed);
+  (void)committed;
+  (void)length;
+}
+
+// 开启异步释放的线程归还的批量对象与大块内存由回收线程释放，释放的内存随后可再次申请
+void TestAsyncFree() {
+  size_t before = AsyncReclaimer::Instance().Reclaimed();
+  size_t fallbacks = 0;
+  std::thread t([&fallbacks]() {
+    ConcurSetAsyncFree(true);
+    std::vector<void *> v;
+    for (size_t i = 0; i < 5000; ++i) {
+      v.push_back(ConcurAlloc(64));
+    }
+    for (void *ptr : v) {
+      ConcurFree(ptr);
+    }
+    ConcurFree(ConcurAlloc(2 << 20));
+    ConcurThreadCacheFlush();
+    fallbacks = ConcurAsyncFreeFallbacks();
+    ConcurSetAsyncFree(false);
+  });
+  t.join();
+
+  // 大块内存与至少一批对象入队，回收线程最长轮询间隔为ASYNC_FREE_MAX_POLL_MS
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (AsyncReclaimer::Instance().Reclaimed() - before + fallbacks < 2 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  assert(AsyncReclaimer::Instance().Reclaimed() - before + fallbacks >= 2);
+
+  std::vector<void *> v;
+  for (size_t i = 0; i < 5000; ++i) {
+    v.push_back(ConcurAlloc(64));
+  }
+  for (void *ptr : v) {
+    ConcurFree(ptr);
+  }
+
+  // 超过硬上限时先释放异步释放队列中尚未处理的大块内存，之后的申请不会失败
+  std::thread limited([]() {
+    ConcurSetAsyncFree(true);
+    void *large = ConcurAlloc(8 << 20);
+    ConcurSetMemoryLimit(0, ConcurGetHeapStats()._committedBytes + (1 << 20));
+    ConcurFree(large);
+    ConcurFree(ConcurAlloc(8 << 20));
+    ConcurSetMemoryLimit(0, 0);
+    ConcurSetAsyncFree(false);
+  });
+  limited.join();
+  (void)before;
+}
+
+// 其他线程停在临界区内时退休的对象不会被复用，该线程退出后逐步推进纪元，对象回到自由链表
+void TestEpochRetire() {
+  const size_t n = 1000;
+  std::atomic<int> state{0};
+  std::thread reader([&state]() {
+    ConcurEpochGuard guard;
+    state = 1;
+    while (state != 2) {
+      std::this_thread::yield();
+    }
+  });
+  while (state != 1) {
+    std::this_thread::yield();
+  }
+
+  std::set<void *> retired;
+  for (size_t i = 0; i < n; ++i) {
+    void *ptr = ConcurAlloc(64);
+    retired.insert(ptr);
+    ConcurRetire(ptr);
+  }
+  void *large = ConcurAlloc(1 << 20);
+  ConcurRetire(large);
+  assert(ConcurEpochReclaim() == n + 1);
+
+  std::vector<void *> v;
+  for (size_t i = 0; i < n; ++i) {
+    v.push_back(ConcurAlloc(64));
+    assert(retired.count(v.back()) == 0);
+  }
+
+  state = 2;
+  reader.join();
+  size_t tries = 0;
+  while (ConcurEpochReclaim() > 0) {
+    assert(++tries < 10);
+  }
+
+  // 退休对象已放回自由链表（超出上限的部分归还CentralCache），再次申请会复用它们
+  size_t reused = 0;
+  for (size_t i = 0; i < n; ++i) {
+    v.push_back(ConcurAlloc(64));
+    reused += retired.count(v.back());
+  }
+  assert(reused > 0);
+  for (void *ptr : v) {
+    ConcurFree(ptr);
+  }
+  (void)tries;
+  (void)reused;
+}
+
+// 链表Span与位图Span取出的对象互不重复、按对象大小对齐，全部归还后Span的分配数回到0
+void TestBitmapSpans() {
+  const size_t bytes = 2048;
+  CentralCache &central = CentralCache::Instance();
+  for (bool bitmap : {false, true}) {
+    ConcurSetBitmapSpans(bitmap);
+    std::set<void *> seen;
+    std::vector<std::pair<void *, void *>> batches;
+    size_t bitmapped = 0;
+    for (size_t i = 0; i < 1000; i += 100) {
+      void *start = nullptr;
+      void *end = nullptr;
+      size_t n = central.RemoveRange(start, end, 100, bytes);
+      for (void *cur = start; n-- > 0; cur = FreeList::Next(cur)) {
+        Span *span = PageHeap::Instance().ObjectToSpan(cur);
+        bitmapped += span->_bitmapped;
+        assert(((char *)cur - (char *)(span->_start << PAGE_SHIFT)) % bytes == 0);
+        assert(seen.insert(cur).second);
+        (void)span;
+      }
+      batches.emplace_back(start, end);
+    }
+    // 之前留下的部分占用Span保持原来的形式，新申请的Span按当前设置
+    assert(bitmap ? bitmapped > 0 : bitmapped < seen.size());
+    for (auto &batch : batches) {
+      central.InsertRange(batch.first, batch.second, bytes);
+    }
+    for (void *ptr : seen) {
+      assert(PageHeap::Instance().ObjectToSpan(ptr)->_useCount == 0 ||
+             PageHeap::Instance().ObjectToSpan(ptr)->_sizeClass == 0);
+      (void)ptr;
+    }
+  }
+  ConcurSetBitmapSpans(true);
+}
+
+// 新线程中的脚本化负载：每次小对象申请要么命中线程缓存要么补充一次，
+// 大块申请若从页堆切分，释放时必与切下的剩余部分合并；向系统映射时映射字节数随之增长
+void TestPathCounters() {
+  const size_t n = 1000;
+  PathStats before = ConcurGetPathStats();
+  HeapStats heapBefore = ConcurGetHeapStats();
+  std::thread t([n]() {
+    std::vector<void *> v;
+    for (size_t round = 0; round < 2; ++round) {
+      for (size_t i = 0; i < n; ++i) {
+        v.push_back(ConcurAlloc(48));
+      }
+      for (void *ptr : v) {
+        ConcurFree(ptr);
+      }
+      v.clear();
+    }
+    ConcurFree(ConcurAlloc(MAX_BYTES + 1));
+  });
+  t.join();
+  PathStats after = ConcurGetPathStats();
+  HeapStats heapAfter = ConcurGetHeapStats();
+
+  size_t delta[PATH_NUM];
+  for (size_t i = 0; i < PATH_NUM; ++i) {
+    delta[i] = after._counts[i] - before._counts[i];
+  }
+  assert(delta[PATH_HIT] + delta[PATH_REFILL] == 2 * n);
+  assert(delta[PATH_REFILL] > 0 && delta[PATH_HIT] > n);
+  assert(delta[PATH_LARGE_ALLOC] == 1);
+  assert(delta[PATH_HEAP_SPLIT] == 0 || delta[PATH_COALESCE] > 0);
+  assert((delta[PATH_MMAP] > 0) == (heapAfter._mappedBytes > heapBefore._mappedBytes));
+  cout << "path counters: hit " << delta[PATH_HIT] << " refill " << delta[PATH_REFILL]
+       << " span " << delta[PATH_ALLOCATE_SPAN] << " split " << delta[PATH_HEAP_SPLIT]
+       << " coalesce " << delta[PATH_COALESCE] << " mmap " << delta[PATH_MMAP] << endl;
+  (void)heapBefore;
+  (void)heapAfter;
+}
+
+#ifdef __linux__
+// 父进程申请的消息由fork出的子进程读取并释放，子进程申请的回复由父进程释放；
+// 另一个子进程解除继承的映射后经fd重新映射，得到同一地址
+void TestSharedHeap() {
+  int fd = -1;
+  SharedHeap *heap = SharedHeap::Create("concur-test", 64 << 20, &fd);
+  assert(heap && fd >= 0);
+  size_t freePages = heap->FreePages();
+
+  // 进程间交换指针的信箱也放在共享堆中
+  void *volatile *mailbox = (void *volatile *)heap->Alloc(sizeof(void *));
+  char *message = (char *)heap->Alloc(1 << 20);
+  memset(message, 'p', 1 << 20);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (size_t i = 0; i < (1 << 20); ++i) {
+      if (message[i] != 'p') {
+        _exit(1);
+      }
+    }
+    heap->Free(message);
+    char *reply = (char *)heap->Alloc(3 << 20);
+    if (reply == nullptr) {
+      _exit(2);
+    }
+    memset(reply, 'c', 3 << 20);
+    *mailbox = reply;
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  char *reply = (char *)*mailbox;
+  assert(heap->Contains(reply) && reply[0] == 'c' && reply[(3 << 20) - 1] == 'c');
+  heap->Free(reply);
+
+  pid = fork();
+  if (pid == 0) {
+    SharedHeap::Detach(heap);
+    SharedHeap *attached = SharedHeap::Attach(fd);
+    if (attached != heap) {
+      _exit(1);
+    }
+    *mailbox = attached->Alloc(100 << 10);
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  heap->Free(*mailbox);
+  heap->Free((void *)mailbox);
+
+  // 全部释放后空闲块合并回初始状态
+  assert(heap->FreePages() == freePages);
+  cout << "shared heap: " << freePages << " pages free after cross-process alloc/free" << endl;
+
+  SharedHeap::Detach(heap);
+  close(fd);
+  (void)reply;
+}
+#endif
+
+#ifdef CONCUR_UNIT_TEST
+// make test：依次运行全部单元测试，断言失败时进程异常退出，返回非零状态
+int main() {
+  const std::pair<const char *, void (*)()> tests[] = {
+      {"TestConcurAlloc1", TestConcurAlloc1},
+      {"TestConcurAlloc2", TestConcurAlloc2},
+      {"TestRealloc", TestRealloc},
+      {"TestCalloc", TestCalloc},
+      {"TestObjectPool", TestObjectPool},
+      {"TestConcurNew", TestConcurNew},
+      {"TestAllocIsolated", TestAllocIsolated},
+      {"TestOwns", TestOwns},
+      {"TestReserve", TestReserve},
+      {"TestHandlePool", TestHandlePool},
+      {"TestBitmapSpans", TestBitmapSpans},
+      {"TestPathCounters", TestPathCounters},
+      {"TestAsyncFree", TestAsyncFree},
+      {"TestEpochRetire", TestEpochRetire},
+      {"TestThreadCacheScavenge", TestThreadCacheScavenge},
+      {"TestEmptySpanLimit", TestEmptySpanLimit},
+      {"TestSpanTail", TestSpanTail},
+      {"TestThreadCacheReclaim", TestThreadCacheReclaim},
+      {"TestThreadExitRace", TestThreadExitRace},
+#ifdef __linux__
+      {"TestSharedHeap", TestSharedHeap},
+#endif
+      {"TestMemoryLimit", TestMemoryLimit},
+  };
+  for (const auto &test : tests) {
+    cout << "[ RUN  ] " << test.first << endl;
+    test.second();
+    cout << "[  OK  ] " << test.first << endl;
+  }
+  cout << "全部" << sizeof(tests) / sizeof(tests[0]) << "项单元测试通过" << endl;
+  return 0;
+}
+#endif
\ No newline at end of file